@@ -1,44 +1,219 @@
 #include <stdio.h>
+#include <stddef.h>
 #include <math.h>
 
 #include "interrupts.h"
 #include "alarm.h"
 #include "queue.h"
 #include "minithread.h"
+#include "trace.h"
+
+/*
+ * Pending alarms live in a hierarchical timing wheel. Level 0 has one slot
+ * per tick for the next WHEEL_SLOTS ticks; each slot of level n covers
+ * WHEEL_SLOTS^n ticks. An alarm is put on the lowest level whose range
+ * covers it, and is moved down a level (cascaded) when the wheel below wraps
+ * around to its slot. Register, deregister and firing are all O(1).
+ */
+#define WHEEL_BITS 8
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+#define WHEEL_MASK (WHEEL_SLOTS - 1)
+#define WHEEL_LEVELS 4
+
+/* Slot of the wheel at level covering tick t */
+#define WHEEL_INDEX(t, level) (((t) >> ((level) * WHEEL_BITS)) & WHEEL_MASK)
 
 /* Definition of alarm */
 struct alarm {
-    int end_time;
+    long end_time;      // tick to go off on
+    uint64_t deadline;  // or monotonic time to go off at, for timer alarms
     alarm_handler_t func;
     void* arg;
+    queue_t *slot;      // wheel slot the alarm is in, NULL if none
+    int heap_index;     // position in timer_heap, -1 if none
+    node_t link;        // link in the wheel slot
 };
 
+static queue_t *wheel[WHEEL_LEVELS][WHEEL_SLOTS];
+static long wheel_next = 0;     // next tick to fire alarms for
+static int alarm_count = 0;     // alarms in the wheel
+
 /*
- * Compare the end time of two alarms.
- * Return 0 if equal, 1 if a1 > a2, -1 if a2 > a1
+ * High-resolution alarms do not go through the wheel. They are kept in a
+ * binary min-heap ordered by deadline, and the one-shot timer is armed for
+ * the earliest of them.
  */
-int compare_alarms(void* a1, void* a2) {
-    int t1 = (*(alarm_t *) a1).end_time;
-    int t2 = (*(alarm_t *) a2).end_time;
-    if (t1 == t2) {
-        return 0;
-    } else if (t1 > t2) {
-        return 1;
+static alarm_t **timer_heap = NULL;
+static int timer_len = 0;
+static int timer_cap = 0;
+static uint64_t timer_armed = 0;        // deadline the timer is set to
+
+void alarm_initialize() {
+    int level, i;
+    for (level = 0; level < WHEEL_LEVELS; level++) {
+        for (i = 0; i < WHEEL_SLOTS; i++)
+            wheel[level][i] = queue_new_intrusive(offsetof(alarm_t, link));
+    }
+    wheel_next = ticks + 1;
+}
+
+/* Put a into the wheel slot for its end time */
+static void alarm_insert(alarm_t *a) {
+    long delta = a -> end_time - wheel_next;
+    int level;
+
+    if (delta < 0) {
+        // Overdue, fire on the next tick
+        a -> slot = wheel[0][WHEEL_INDEX(wheel_next, 0)];
     } else {
-        return -1;
+        for (level = 0; level < WHEEL_LEVELS - 1; level++) {
+            if (delta < 1L << ((level + 1) * WHEEL_BITS))
+                break;
+        }
+        a -> slot = wheel[level][WHEEL_INDEX(a -> end_time, level)];
+    }
+    queue_append(a -> slot, a);
+}
+
+/* Move the alarms of slot index of level down the wheel, return index */
+static int alarm_cascade(int level, int index) {
+    queue_t *slot = wheel[level][index];
+    alarm_t *a;
+
+    while (queue_dequeue(slot, (void **) &a) == 0)
+        alarm_insert(a);
+    return index;
+}
+
+static void heap_set(int i, alarm_t *a) {
+    timer_heap[i] = a;
+    a -> heap_index = i;
+}
+
+static void heap_up(int i) {
+    alarm_t *a = timer_heap[i];
+    while (i > 0 && timer_heap[(i - 1) / 2] -> deadline > a -> deadline) {
+        heap_set(i, timer_heap[(i - 1) / 2]);
+        i = (i - 1) / 2;
+    }
+    heap_set(i, a);
+}
+
+static void heap_down(int i) {
+    alarm_t *a = timer_heap[i];
+    int child;
+    while ((child = 2 * i + 1) < timer_len) {
+        if (child + 1 < timer_len &&
+            timer_heap[child + 1] -> deadline < timer_heap[child] -> deadline)
+            child++;
+        if (a -> deadline <= timer_heap[child] -> deadline)
+            break;
+        heap_set(i, timer_heap[child]);
+        i = child;
+    }
+    heap_set(i, a);
+}
+
+static int heap_insert(alarm_t *a) {
+    if (timer_len == timer_cap) {
+        int cap = timer_cap == 0 ? 16 : timer_cap * 2;
+        alarm_t **heap = realloc(timer_heap, cap * sizeof(alarm_t *));
+        if (heap == NULL)
+            return -1;
+        timer_heap = heap;
+        timer_cap = cap;
+    }
+    heap_set(timer_len++, a);
+    heap_up(a -> heap_index);
+    return 0;
+}
+
+static void heap_remove(alarm_t *a) {
+    alarm_t *last = timer_heap[--timer_len];
+    int i = a -> heap_index;
+    a -> heap_index = -1;
+    if (last != a) {
+        heap_set(i, last);
+        heap_up(i);
+        heap_down(last -> heap_index);
+    }
+}
+
+/* Arm the one-shot timer for the earliest high-resolution alarm */
+static void timer_update() {
+    uint64_t deadline = timer_len > 0 ? timer_heap[0] -> deadline : 0;
+    if (deadline != timer_armed) {
+        minithread_timer_set(deadline);
+        timer_armed = deadline;
     }
 }
 
 void do_alarms() {
-    alarm_handler_t f;
-    alarm_t *curr_alarm = queue_peek(alarm_list);
-    while (curr_alarm != NULL && curr_alarm -> end_time <= ticks) {
-        f = curr_alarm -> func;
-        f(curr_alarm -> arg);
-        int ret = queue_dequeue(alarm_list, (void **) &curr_alarm);
-        assert(ret != -1);
-        curr_alarm = queue_peek(alarm_list);
+    alarm_t *a;
+    queue_t *slot;
+    int index;
+
+    TRACE(TRACE_ALARMS_BEGIN, 0, 0);
+    // Nothing to fire, skip ahead
+    if (alarm_count == 0 && wheel_next <= ticks)
+        wheel_next = ticks + 1;
+
+    while (wheel_next <= ticks) {
+        index = WHEEL_INDEX(wheel_next, 0);
+        if (index == 0 &&
+            alarm_cascade(1, WHEEL_INDEX(wheel_next, 1)) == 0 &&
+            alarm_cascade(2, WHEEL_INDEX(wheel_next, 2)) == 0)
+            alarm_cascade(3, WHEEL_INDEX(wheel_next, 3));
+        wheel_next++;
+
+        // Stop at alarms a handler just registered a revolution ahead
+        slot = wheel[0][index];
+        while ((a = queue_peek(slot)) != NULL && a -> end_time < wheel_next) {
+            queue_dequeue(slot, (void **) &a);
+            a -> slot = NULL;
+            alarm_count--;
+            a -> func(a -> arg);
+        }
+    }
+
+    if (timer_len > 0) {
+        uint64_t now = minithread_clock_now();
+        while (timer_len > 0 && timer_heap[0] -> deadline <= now) {
+            a = timer_heap[0];
+            heap_remove(a);
+            a -> func(a -> arg);
+        }
     }
+    timer_update();
+    TRACE(TRACE_ALARMS_END, 0, 0);
+}
+
+long alarm_next_tick() {
+    long base, t, next = -1;
+    int level, i;
+
+    if (alarm_count == 0)
+        return -1;
+
+    // Level 0 knows the exact tick of everything due in the next revolution
+    for (i = 0; i < WHEEL_SLOTS; i++) {
+        if (queue_length(wheel[0][WHEEL_INDEX(wheel_next + i, 0)]) > 0)
+            return wheel_next + i;
+    }
+
+    // Otherwise wake up for the first cascade that has alarms to move
+    for (level = 1; level < WHEEL_LEVELS; level++) {
+        base = wheel_next >> (level * WHEEL_BITS);
+        for (i = 1; i <= WHEEL_SLOTS; i++) {
+            if (queue_length(wheel[level][(base + i) & WHEEL_MASK]) > 0) {
+                t = (base + i) << (level * WHEEL_BITS);
+                if (next == -1 || t < next)
+                    next = t;
+                break;
+            }
+        }
+    }
+    return next;
 }
 
 alarm_id alarm_register(int delay, alarm_handler_t alarm, void *arg) {
@@ -47,22 +222,56 @@ alarm_id alarm_register(int delay, alarm_handler_t alarm, void *arg) {
         fprintf(stderr, "Failed to register alarm\n");
         return NULL;
     }
-    int r = (delay * MILLISECOND) / PERIOD;
+    long r = ((long) delay * MILLISECOND) / PERIOD;
     // Delay = 0, handle it on the next clock tick
-    if ((delay == 0) || (delay * MILLISECOND) % PERIOD != 0) {
+    if ((delay == 0) || ((long) delay * MILLISECOND) % PERIOD != 0) {
         // End-time in between two ticks will round up to next tick
         r++;
     }
     a -> end_time = ticks + r;
+    a -> deadline = 0;
+    a -> func = alarm;
+    a -> arg = arg;
+    a -> heap_index = -1;
+    alarm_insert(a);
+    alarm_count++;
+    return a;
+}
+
+alarm_id alarm_register_at(uint64_t deadline, alarm_handler_t alarm, void *arg) {
+    alarm_t* a = (alarm_t*) malloc(sizeof(alarm_t));
+    if (a == NULL) {
+        fprintf(stderr, "Failed to register alarm\n");
+        return NULL;
+    }
+    a -> end_time = -1;
+    a -> deadline = deadline;
     a -> func = alarm;
     a -> arg = arg;
-    queue_sorted_insert(alarm_list, (void*) a, compare_alarms);
+    a -> slot = NULL;
+    if (heap_insert(a) == -1) {
+        free(a);
+        fprintf(stderr, "Failed to register alarm\n");
+        return NULL;
+    }
+    timer_update();
     return a;
 }
 
+alarm_id alarm_register_ns(uint64_t delay, alarm_handler_t alarm, void *arg) {
+    return alarm_register_at(minithread_clock_now() + delay, alarm, arg);
+}
+
 int alarm_deregister(alarm_id alarm) {
-    int end_time = ((alarm_t*) alarm) -> end_time;
-    queue_delete(alarm_list, (void*) alarm);
+    alarm_t *a = (alarm_t *) alarm;
+    int fired = (a -> slot == NULL && a -> heap_index == -1);
+    if (a -> slot != NULL) {
+        queue_delete(a -> slot, a);
+        alarm_count--;
+    } else if (a -> heap_index != -1) {
+        heap_remove(a);
+        timer_update();
+    }
     free(alarm);
-    return end_time <= ticks;
-}
\ No newline at end of file
+    return fired;
+}
@@ -1,6 +1,8 @@
 #ifndef __ALARM_H__
 #define __ALARM_H__ 1
 
+#include <stdint.h>
+
 /*
  * This is the alarm interface. You should implement the functions for these
  * prototypes, though you may have to modify some other files to do so.
@@ -16,17 +18,39 @@ typedef void *alarm_id;
 
 typedef struct alarm alarm_t;
 
+/*
+ * Create the timing wheel that holds pending alarms. Registering,
+ * deregistering and firing an alarm take constant time, however many alarms
+ * are pending.
+ */
+void alarm_initialize();
+
 /*
  * Fire all alarms that are ready
  */
 void do_alarms();
 
+/*
+ * Return a tick no later than the one the earliest pending alarm goes off
+ * on, or -1 if no alarm is pending. do_alarms must run by that tick.
+ */
+long alarm_next_tick();
+
 /*
  * Register an alarm to go off in "delay" milliseconds.  Returns a handle to
  * the alarm.
  */
 alarm_id alarm_register(int delay, alarm_handler_t func, void *arg);
 
+/*
+ * Register an alarm to go off at monotonic time "deadline" (in nanoseconds,
+ * see minithread_clock_now), or "delay" nanoseconds from now. These alarms
+ * are not rounded to clock ticks: a one-shot timer interrupt is programmed
+ * for the earliest of them.
+ */
+alarm_id alarm_register_at(uint64_t deadline, alarm_handler_t func, void *arg);
+alarm_id alarm_register_ns(uint64_t delay, alarm_handler_t func, void *arg);
+
 /*
  * Unregister an alarm. Returns 0 if the alarm had not been executed, and 1
  * otherwise.
@@ -3,17 +3,22 @@
 #include <string.h>
 #include <sys/socket.h>
 #include <sys/time.h>
+#include <sys/select.h>
+#include <time.h>
 #include <signal.h>
 #include <fcntl.h>
 #include <pthread.h>
+#include <sched.h>
 #include <ucontext.h>
 #include <semaphore.h>
+#include <sys/syscall.h>
 #include "defs.h"
 #include "interrupts.h"
 #include "interrupts_private.h"
 #include "minithread.h"
 #include "assert.h"
 #include "machineprimitives.h"
+#include "trace.h"
 
 #define MAXEVENTS 64
 #define DISK_INTERRUPT_TYPE 4
@@ -24,7 +29,6 @@
 #define ENABLED 1
 #define DISABLED 0
 
-interrupt_level_t interrupt_level;
 long ticks;
 extern int start();
 extern int end();
@@ -32,17 +36,81 @@ extern int end();
 /*
  * Virtual processor interrupt level (spl).
  * Are interrupts enabled? A new interrupt will only be taken when interrupts
- * are enabled.
+ * are enabled. Every virtual CPU (host thread) has its own level.
  */
-interrupt_level_t interrupt_level;
+__thread interrupt_level_t interrupt_level;
 
+/*
+ * The kernel lock. Disabling interrupts on a virtual CPU also takes this
+ * lock, so kernel data structures that are protected by disabling interrupts
+ * stay protected when several virtual CPUs run at the same time.
+ */
+static volatile tas_lock_t kernel_lock = 0;
+static __thread int kernel_lock_held = 0;
+
+/*
+ * The clock. Ticks are counted on CLOCK_MONOTONIC from clock_start, and every
+ * CPU's timer fires on that same grid of PERIOD boundaries. A sleeping CPU
+ * disarms its timer; clock_sleeping is set while it is blocked in the host.
+ */
+static struct timespec clock_start;
+static __thread timer_t clock_timer;
+static __thread int clock_armed = 0;
+static __thread volatile int clock_sleeping = 0;
+
+/*
+ * The wakeup signal, sent by minithread_clock_wake, gets a sleeping CPU out
+ * of the host, and is taken as an interrupt that runs the timer handler, so
+ * a running CPU notices at once that it should reschedule.
+ */
+#define WAKEUP_SIGNAL (SIGRTMAX-3)
+
+/*
+ * The one-shot timer behind high-resolution alarms. It interrupts CPU 0 at
+ * an exact deadline.
+ */
+#define TIMER_SIGNAL (SIGRTMAX-4)
+
+static timer_t alarm_timer;
+
+static void clock_arm();
+static void interrupt_replay();
+
+/*
+ * Interrupts that arrived while a CPU could not take them, one bit per
+ * kind. set_interrupt_level replays them when it enables interrupts again,
+ * so none is lost, and none waits longer than the critical section (or
+ * library call) it hit. An interrupt that is taken clears its bit, since
+ * running its handler once covers every one of its kind pending.
+ */
+#define PENDING_CLOCK   1
+#define PENDING_TIMER   2       /* the one-shot timer or a wakeup */
+#define PENDING_DEVICE  4       /* queued device interrupts */
+
+static __thread volatile int interrupt_pending = 0;
+
+/*
+ * An interrupt that hit library code with interrupts enabled may wait long
+ * for the CPU to enable them again, so the CPU is also sent a wakeup
+ * INTERRUPT_RETRY later by its retry timer, and its handler replays them.
+ */
+#define INTERRUPT_RETRY (50 * MICROSECOND)
+
+static __thread timer_t retry_timer;
+
+/*
+ * Device interrupts queued by send_interrupt, newest first. The signal
+ * only says there are some: whichever CPU takes it (or replays it) runs
+ * every one queued, so a signal is raised only when the queue was empty.
+ */
 typedef struct interrupt_t interrupt_t;
 struct interrupt_t {
   interrupt_handler_t handler;
   void *arg;
+  interrupt_t *next;
 };
 
-static pthread_mutex_t signal_mutex;
+static interrupt_t * volatile interrupt_queue = NULL;
 
 #define R8 0
 #define R9 1
@@ -61,25 +129,55 @@ static pthread_mutex_t signal_mutex;
 #define RCX 14
 #define RSP 15
 #define RIP 16
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id _sigev_un._tid
+#endif
+#define FP_XSTATE_MAGIC1_OFFSET 464
 #define errExit(msg)    do { perror(msg); exit(EXIT_FAILURE); \
        } while (0)
 
 
 interrupt_handler_t mini_clock_handler;
+interrupt_handler_t mini_timer_handler;
 interrupt_handler_t mini_network_handler;
 interrupt_handler_t mini_read_handler;
 interrupt_handler_t mini_disk_handler;
 
-static volatile int signal_handled = 0;
-
-sem_t interrupt_received_sema;
-
 /*
  * atomically sets interrupt level and returns the original
  * interrupt level
  */
 interrupt_level_t set_interrupt_level(interrupt_level_t newlevel) {
-    return swap(&interrupt_level, newlevel);
+    interrupt_level_t old_level;
+
+    if (newlevel == DISABLED) {
+        old_level = swap(&interrupt_level, DISABLED);
+        if (!kernel_lock_held) {
+            spinlock_acquire((tas_lock_t *) &kernel_lock);
+            kernel_lock_held = 1;
+        }
+        return old_level;
+    }
+
+    /* Drop the lock while interrupts are still off on this CPU */
+    if (kernel_lock_held) {
+        kernel_lock_held = 0;
+        spinlock_release((tas_lock_t *) &kernel_lock);
+    }
+    old_level = swap(&interrupt_level, newlevel);
+    if (newlevel == ENABLED && interrupt_pending != 0)
+        interrupt_replay();
+    return old_level;
+}
+
+interrupt_level_t set_interrupt_level_local(interrupt_level_t newlevel) {
+    if (newlevel == DISABLED)
+        return swap(&interrupt_level, DISABLED);
+    return set_interrupt_level(newlevel);
+}
+
+int kernel_locked() {
+    return kernel_lock_held;
 }
 
 
@@ -97,14 +195,38 @@ interrupt_level_t set_interrupt_level(interrupt_level_t newlevel) {
  */
 void
 minithread_clock_init(interrupt_handler_t clock_handler){
-    timer_t timerid;
-    struct sigevent sev;
-    struct itimerspec its;
     struct sigaction sa;
-    stack_t ss;
     mini_clock_handler = clock_handler;
 
-    sem_init(&interrupt_received_sema,0,0);
+    // printf("SIGRTMAX = %d\n",SIGRTMAX);
+
+    /* Establish handler for timer signal */
+    sa.sa_handler = (void*)handle_interrupt;
+    sa.sa_flags = SA_SIGINFO | SA_RESTART | SA_ONSTACK;
+    sa.sa_sigaction= (void*)handle_interrupt;
+    interrupt_signals(&sa.sa_mask);
+    if (sigaction(SIGRTMAX-1, &sa, NULL) == -1)
+        errExit("sigaction");
+
+    if (sigaction(WAKEUP_SIGNAL, &sa, NULL) == -1)
+        errExit("sigaction");
+
+    clock_gettime(CLOCK_MONOTONIC, &clock_start);
+
+    minithread_clock_init_cpu();
+}
+
+/*
+ * Start the clock of the virtual CPU driven by the calling host thread.
+ *
+ * Every CPU takes its interrupts on its own signal stack, and its timer
+ * signal is directed at its own host thread so that each CPU is preempted
+ * independently.
+ */
+void
+minithread_clock_init_cpu(){
+    struct sigevent sev;
+    stack_t ss;
 
     ss.ss_sp = malloc(SIGSTKSZ);
     if (ss.ss_sp == NULL){
@@ -118,35 +240,231 @@ minithread_clock_init(interrupt_handler_t clock_handler){
         abort();
     }
 
-    // printf("SIGRTMAX = %d\n",SIGRTMAX);
+    /* Create the timer */
+    memset(&sev, 0, sizeof(sev));
+    sev.sigev_notify = SIGEV_THREAD_ID;
+    sev.sigev_signo = SIGRTMAX-1;
+    sev.sigev_value.sival_ptr = &clock_timer;
+    sev.sigev_notify_thread_id = syscall(SYS_gettid);
+    if (timer_create(CLOCK_MONOTONIC, &sev, &clock_timer) == -1)
+        errExit("timer_create");
+
+    sev.sigev_signo = WAKEUP_SIGNAL;
+    sev.sigev_value.sival_ptr = &retry_timer;
+    if (timer_create(CLOCK_MONOTONIC, &sev, &retry_timer) == -1)
+        errExit("timer_create");
+
+    /* Start the timer */
+    clock_arm();
+}
+
+/* Time of the start of tick t on CLOCK_MONOTONIC */
+static struct timespec
+clock_tick_time(long t){
+    struct timespec ts;
+    uint64_t ns = clock_start.tv_nsec + (uint64_t) t * PERIOD;
+
+    ts.tv_sec = clock_start.tv_sec + ns / SECOND;
+    ts.tv_nsec = ns % SECOND;
+    return ts;
+}
+
+/* Fire the clock of the calling CPU on every tick from the next one on */
+static void
+clock_arm(){
+    struct itimerspec its;
+
+    its.it_value = clock_tick_time(minithread_clock_ticks() + 1);
+    its.it_interval.tv_sec = (PERIOD) / SECOND;
+    its.it_interval.tv_nsec = (PERIOD) % SECOND;
+    if (timer_settime(clock_timer, TIMER_ABSTIME, &its, NULL) == -1)
+        errExit("timer_settime");
+    clock_armed = 1;
+}
+
+static void
+clock_disarm(){
+    struct itimerspec its;
+
+    memset(&its, 0, sizeof(its));
+    if (timer_settime(clock_timer, 0, &its, NULL) == -1)
+        errExit("timer_settime");
+    clock_armed = 0;
+}
+
+long
+minithread_clock_ticks(){
+    struct timespec now;
+    int64_t ns;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    ns = (int64_t) (now.tv_sec - clock_start.tv_sec) * SECOND +
+        (now.tv_nsec - clock_start.tv_nsec);
+    return ns / PERIOD;
+}
+
+void
+minithread_clock_sleep(long wake_tick, volatile int *ready){
+    sigset_t mask, old_mask;
+    struct timespec now, deadline, timeout, *tp = NULL;
+
+    /*
+     * Hold off interrupts between checking *ready and blocking; pselect
+     * unblocks them atomically, so a wakeup sent in between is not lost.
+     */
+    interrupt_signals(&mask);
+    pthread_sigmask(SIG_BLOCK, &mask, &old_mask);
+
+    /* An interrupt that came while we could not take it ends the sleep too */
+    if (*ready == 0 && interrupt_pending == 0) {
+        if (wake_tick >= 0) {
+            deadline = clock_tick_time(wake_tick);
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            timeout.tv_sec = deadline.tv_sec - now.tv_sec;
+            timeout.tv_nsec = deadline.tv_nsec - now.tv_nsec;
+            if (timeout.tv_nsec < 0) {
+                timeout.tv_sec--;
+                timeout.tv_nsec += SECOND;
+            }
+            if (timeout.tv_sec < 0)
+                timeout.tv_sec = timeout.tv_nsec = 0;
+            tp = &timeout;
+        }
+        clock_disarm();
+        clock_sleeping = 1;
+        pselect(0, NULL, NULL, NULL, tp, &old_mask);
+        clock_sleeping = 0;
+        if (!clock_armed)
+            clock_arm();
+    }
+
+    pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+}
+
+void
+minithread_clock_wake(pthread_t host){
+    pthread_kill(host, WAKEUP_SIGNAL);
+}
+
+uint64_t
+minithread_clock_now(){
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * SECOND + now.tv_nsec;
+}
+
+void
+interrupt_signals(sigset_t *set){
+    sigemptyset(set);
+    sigaddset(set, SIGRTMAX-1);
+    sigaddset(set, SIGRTMAX-2);
+    sigaddset(set, WAKEUP_SIGNAL);
+    sigaddset(set, TIMER_SIGNAL);
+}
+
+void
+minithread_timer_init(interrupt_handler_t timer_handler){
+    struct sigaction sa;
+    struct sigevent sev;
+
+    mini_timer_handler = timer_handler;
 
-    /* Establish handler for timer signal */
-    sa.sa_handler = (void*)handle_interrupt;
     sa.sa_flags = SA_SIGINFO | SA_RESTART | SA_ONSTACK;
-    sa.sa_sigaction= (void*)handle_interrupt;
-    sigemptyset(&sa.sa_mask);
-    sigaddset(&sa.sa_mask,SIGRTMAX-1);
-    sigaddset(&sa.sa_mask,SIGRTMAX-2);
-    if (sigaction(SIGRTMAX-1, &sa, NULL) == -1)
+    sa.sa_sigaction = (void*)handle_interrupt;
+    interrupt_signals(&sa.sa_mask);
+    if (sigaction(TIMER_SIGNAL, &sa, NULL) == -1)
         errExit("sigaction");
 
-    /* Create the timer */
-    sev.sigev_notify = SIGEV_SIGNAL;
-    sev.sigev_signo = SIGRTMAX-1;
-    sev.sigev_value.sival_ptr = &timerid;
-    if (timer_create(CLOCK_THREAD_CPUTIME_ID, &sev, &timerid) == -1)
+    memset(&sev, 0, sizeof(sev));
+    sev.sigev_notify = SIGEV_THREAD_ID;
+    sev.sigev_signo = TIMER_SIGNAL;
+    sev.sigev_value.sival_ptr = &alarm_timer;
+    sev.sigev_notify_thread_id = syscall(SYS_gettid);
+    if (timer_create(CLOCK_MONOTONIC, &sev, &alarm_timer) == -1)
         errExit("timer_create");
+}
 
-    /* Start the timer */
-    its.it_value.tv_sec = (PERIOD) / 1000000000;
-    its.it_value.tv_nsec = (PERIOD) % 1000000000;
-    its.it_interval.tv_sec = its.it_value.tv_sec;
-    its.it_interval.tv_nsec = its.it_value.tv_nsec;
+void
+minithread_timer_set(uint64_t deadline){
+    struct itimerspec its;
 
-    if (timer_settime(timerid, 0, &its, NULL) == -1)
+    memset(&its, 0, sizeof(its));
+    its.it_value.tv_sec = deadline / SECOND;
+    its.it_value.tv_nsec = deadline % SECOND;
+    if (timer_settime(alarm_timer, TIMER_ABSTIME, &its, NULL) == -1)
         errExit("timer_settime");
 }
 
+/* Interrupt this CPU again a little later, see INTERRUPT_RETRY */
+static void
+interrupt_retry(){
+    struct itimerspec its;
+
+    memset(&its, 0, sizeof(its));
+    its.it_value.tv_nsec = INTERRUPT_RETRY;
+    timer_settime(retry_timer, 0, &its, NULL);
+}
+
+/* Pending bit of the interrupt signal sig */
+static int
+interrupt_kind(int sig){
+    if(sig==SIGRTMAX-1)
+        return PENDING_CLOCK;
+    if(sig==SIGRTMAX-2)
+        return PENDING_DEVICE;
+    return PENDING_TIMER;
+}
+
+/*
+ * Handler of the device interrupt signal: run every queued interrupt, in
+ * the order they were sent. Holding the kernel lock while taking the queue
+ * keeps batches taken on different CPUs in order too.
+ */
+static void
+interrupt_run_queued(void *arg){
+    interrupt_level_t old_level = set_interrupt_level(DISABLED);
+    interrupt_t *list, *next, *prev = NULL;
+
+    list = __sync_lock_test_and_set(&interrupt_queue, NULL);
+    while (list != NULL) {
+        next = list->next;
+        list->next = prev;
+        prev = list;
+        list = next;
+    }
+    while (prev != NULL) {
+        next = prev->next;
+        prev->handler(prev->arg);
+        free(prev);
+        prev = next;
+    }
+    set_interrupt_level(old_level);
+}
+
+/*
+ * Run the handlers of the interrupts pending on this CPU, which just
+ * enabled interrupts. They run one at a time, as a handler may switch
+ * threads, and we may come back on another CPU with other ones pending.
+ */
+static void
+interrupt_replay(){
+    int pending;
+
+    while ((pending = interrupt_pending) != 0) {
+        if (pending & PENDING_DEVICE) {
+            __sync_fetch_and_and(&interrupt_pending, ~PENDING_DEVICE);
+            interrupt_run_queued(NULL);
+        } else if (pending & PENDING_TIMER) {
+            __sync_fetch_and_and(&interrupt_pending, ~PENDING_TIMER);
+            mini_timer_handler(NULL);
+        } else {
+            __sync_fetch_and_and(&interrupt_pending, ~PENDING_CLOCK);
+            mini_clock_handler(NULL);
+        }
+    }
+}
+
 
 /*
  * This function handles a signal and invokes the specified interrupt
@@ -156,6 +474,10 @@ void
 handle_interrupt(int sig, siginfo_t *si, ucontext_t *ucontext)
 {
     uint64_t eip = ucontext->uc_mcontext.gregs[RIP];
+
+    /* A wakeup before there is a timer handler only ends a sleep */
+    if(sig==WAKEUP_SIGNAL && mini_timer_handler==NULL)
+        return;
     /*
      * This allows us to check the interrupt level
      * and effectively block other signals.
@@ -166,10 +488,24 @@ handle_interrupt(int sig, siginfo_t *si, ucontext_t *ucontext)
      * calls.
      */
     if(interrupt_level==ENABLED &&
-            eip > (uint64_t)start &&
-            eip < (uint64_t)end){
+            ((eip > (uint64_t)start && eip < (uint64_t)end) ||
+             clock_sleeping)){
 
         unsigned long *newsp;
+
+        /*
+         * A CPU sleeping in minithread_clock_sleep takes the interrupt
+         * right there, and the handler may switch away from the idle
+         * thread: restart the clock and unblock interrupts first.
+         */
+        if (clock_sleeping) {
+            clock_sleeping = 0;
+            clock_arm();
+            sigdelset(&ucontext->uc_sigmask, SIGRTMAX-1);
+            sigdelset(&ucontext->uc_sigmask, SIGRTMAX-2);
+            sigdelset(&ucontext->uc_sigmask, WAKEUP_SIGNAL);
+            sigdelset(&ucontext->uc_sigmask, TIMER_SIGNAL);
+        }
         /*
          * push the return address
          */
@@ -184,6 +520,12 @@ handle_interrupt(int sig, siginfo_t *si, ucontext_t *ucontext)
         if(ucontext->uc_mcontext.fpregs!=0){
             newsp -= sizeof(struct _fpstate)/sizeof(long);
             memcpy(newsp,ucontext->uc_mcontext.fpregs,sizeof(struct _fpstate));
+            /*
+             * Only the legacy fxsave area is copied, so clear the xsave
+             * magic in its software-reserved bytes. Otherwise sigreturn
+             * reads the full xstate past the copy, off the top of the stack.
+             */
+            ((uint32_t *) newsp)[FP_XSTATE_MAGIC1_OFFSET / 4] = 0;
             ucontext->uc_mcontext.fpregs = (void *)newsp;
         }
 
@@ -199,10 +541,18 @@ handle_interrupt(int sig, siginfo_t *si, ucontext_t *ucontext)
          * the stack.
          */
         if(sig==SIGRTMAX-2){
+            /*
+             * The handler disables interrupts itself, so the kernel lock is
+             * never taken from signal context.
+             */
+            ucontext->uc_mcontext.gregs[RSP]=(unsigned long)newsp;
+            ucontext->uc_mcontext.gregs[RIP]=(unsigned long)interrupt_run_queued;
+            ucontext->uc_mcontext.gregs[RDI]=(unsigned long)0;
+        }
+        else if(sig==TIMER_SIGNAL || sig==WAKEUP_SIGNAL){
             ucontext->uc_mcontext.gregs[RSP]=(unsigned long)newsp;
-            ucontext->uc_mcontext.gregs[RIP]=(unsigned long)((interrupt_t*)si->si_value.sival_ptr)->handler;
-            ucontext->uc_mcontext.gregs[RDI]=(unsigned long)((interrupt_t*)si->si_value.sival_ptr)->arg;
-            set_interrupt_level(DISABLED);
+            ucontext->uc_mcontext.gregs[RIP]=(unsigned long)mini_timer_handler;
+            ucontext->uc_mcontext.gregs[RDI]=(unsigned long)0;
         }
         else if(sig==SIGRTMAX-1){
             ucontext->uc_mcontext.gregs[RSP]=(unsigned long)newsp;
@@ -216,46 +566,44 @@ handle_interrupt(int sig, siginfo_t *si, ucontext_t *ucontext)
             fflush(stdout);
             abort();
         }
-        if(sig==SIGRTMAX-2)
-            signal_handled = 1;
+        interrupt_pending &= ~interrupt_kind(sig);
     }
-
-    if(sig==SIGRTMAX-2){
-        if(DEBUG)
-            printf("Signal received\n");
-        sem_post(&interrupt_received_sema);
+    else {
+        /* Replay it as soon as this CPU enables interrupts */
+        interrupt_pending |= interrupt_kind(sig);
+        if(interrupt_level==ENABLED)
+            interrupt_retry();
     }
 }
 
 void send_interrupt(int interrupt_type, interrupt_handler_t handler, void* arg){
 
-    interrupt_t interrupt;
-    pthread_mutex_lock(&signal_mutex);
-    for (;;){
-        signal_handled = 0;
-
-        interrupt.arg = arg;
-        if(interrupt_type==NETWORK_INTERRUPT_TYPE)
-            interrupt.handler = mini_network_handler;
-        else if(interrupt_type==READ_INTERRUPT_TYPE)
-            interrupt.handler = mini_read_handler;
-        else if(interrupt_type==DISK_INTERRUPT_TYPE)
-            interrupt.handler = mini_disk_handler;
-        else
-            abort();
-
-        /* Repeat if signal is not delivered. */
-        while(sigqueue(getpid(),SIGRTMAX-2, (union sigval)(void*)&interrupt)==-1);
-
-        /* semaphore_P to wait for main thread signal */
-        sem_wait(&interrupt_received_sema);
+    interrupt_t *interrupt, *head;
+    TRACE(TRACE_INTERRUPT_BEGIN, interrupt_type, arg);
+    interrupt = (interrupt_t *) malloc(sizeof(interrupt_t));
+    assert(interrupt != NULL);
+
+    interrupt->arg = arg;
+    if(interrupt_type==NETWORK_INTERRUPT_TYPE)
+        interrupt->handler = mini_network_handler;
+    else if(interrupt_type==READ_INTERRUPT_TYPE)
+        interrupt->handler = mini_read_handler;
+    else if(interrupt_type==DISK_INTERRUPT_TYPE)
+        interrupt->handler = mini_disk_handler;
+    else
+        abort();
 
-        /* Check if interrupt was handled */
-        if(signal_handled)
-            break;
+    do {
+        head = interrupt_queue;
+        interrupt->next = head;
+    } while (!__sync_bool_compare_and_swap(&interrupt_queue, head, interrupt));
 
-        sleep(0);
-        /* resend if necessary */
-    }
-    pthread_mutex_unlock(&signal_mutex);
+    /*
+     * The signal is never lost once queued, as a CPU that cannot take it
+     * replays it later. Only a full signal queue makes us send it again.
+     */
+    if (head == NULL)
+        while (sigqueue(getpid(), SIGRTMAX-2, (union sigval) NULL) == -1)
+            sched_yield();
+    TRACE(TRACE_INTERRUPT_END, 0, 0);
 }
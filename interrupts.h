@@ -15,6 +15,8 @@
 #ifndef __INTERRUPTS_H__
 #define __INTERRUPTS_H__ 1
 
+#include <pthread.h>
+#include <stdint.h>
 #include "defs.h"
 
 /*
@@ -33,10 +35,11 @@ extern long ticks;
 /*
  * Virtual processor interrupt level.
  * Are interrupts enabled? A new interrupt will only be taken when interrupts
- * are enabled.
+ * are enabled. Each virtual CPU has its own interrupt level; disabling
+ * interrupts also acquires the kernel lock shared by all CPUs.
  */
 typedef int interrupt_level_t;
-extern interrupt_level_t interrupt_level;
+extern __thread interrupt_level_t interrupt_level;
 
 #define DISABLED 0
 #define ENABLED 1
@@ -76,14 +79,74 @@ typedef void(*interrupt_handler_t)(void*);
 
 interrupt_level_t set_interrupt_level(interrupt_level_t newlevel);
 
+/*
+ * Like set_interrupt_level, but disabling interrupts this way holds off
+ * interrupts on this CPU only, without taking the kernel lock. For code that
+ * guards what it touches with spinlocks of its own. Enabling interrupts
+ * either way drops the kernel lock if this CPU holds it.
+ */
+interrupt_level_t set_interrupt_level_local(interrupt_level_t newlevel);
+
+/*
+ * kernel_locked returns 1 if this CPU holds the kernel lock, else 0.
+ */
+int kernel_locked();
+
 /*
  * minithread_clock_init installs your clock interrupt service routine
  * h.  h will be called every PERIOD microseconds (defined above).
  * interrupts are disabled after minithread_clock_init finishes.
  * After you enable interrupts then your handler will be called
- * automatically on every clock tick.
+ * automatically on every clock tick, except while the CPU sleeps in
+ * minithread_clock_sleep.
  */
 void minithread_clock_init(interrupt_handler_t h);
 
+/*
+ * minithread_clock_init_cpu starts the clock of the virtual CPU driven by
+ * the calling host thread. minithread_clock_init does this for the CPU it
+ * is called on; every additional CPU calls it once when it starts.
+ */
+void minithread_clock_init_cpu();
+
+/*
+ * minithread_clock_ticks returns the number of clock ticks since the clock
+ * was started. The clock runs on host monotonic time, so it keeps counting
+ * while CPUs sleep and their periodic ticks are stopped.
+ */
+long minithread_clock_ticks();
+
+/*
+ * minithread_clock_sleep blocks the host thread of the calling CPU until an
+ * interrupt arrives, the CPU is woken with minithread_clock_wake, or tick
+ * wake_tick starts (wake_tick < 0 means no timeout). It returns at once if
+ * *ready is nonzero. The CPU's periodic tick is stopped while it sleeps.
+ * Call it with interrupts enabled.
+ */
+void minithread_clock_sleep(long wake_tick, volatile int *ready);
+
+/*
+ * minithread_clock_wake wakes the CPU driven by host thread host if it is
+ * sleeping in minithread_clock_sleep, and otherwise interrupts it to run the
+ * timer handler (see minithread_timer_init) if interrupts are enabled there.
+ */
+void minithread_clock_wake(pthread_t host);
+
+/*
+ * minithread_clock_now returns the host monotonic time in nanoseconds. This
+ * is the time base of high-resolution deadlines.
+ */
+uint64_t minithread_clock_now();
+
+/*
+ * minithread_timer_init installs the handler of the one-shot timer
+ * interrupt, which is taken by the calling CPU; CPUs interrupted by
+ * minithread_clock_wake run it too. minithread_timer_set arms
+ * the timer to interrupt at monotonic time deadline (in nanoseconds, see
+ * minithread_clock_now), replacing any earlier setting; 0 disarms it.
+ */
+void minithread_timer_init(interrupt_handler_t h);
+void minithread_timer_set(uint64_t deadline);
+
 #endif /* __INTERRUPTS_H__ */
 
@@ -7,6 +7,7 @@
 #ifndef __INTERRUPTS_PRIVATE_H_
 #define __INTERRUPTS_PRIVATE_H_
 
+#include <signal.h>
 #include "interrupts.h"
 
 
@@ -42,5 +43,11 @@ mini_disk_handler;
 
 void send_interrupt(int interrupt_type, interrupt_handler_t handler, void* arg);
 
+/*
+ * Fill set with every signal that delivers an interrupt to a CPU. Interrupt
+ * signal handlers must block all of them, so interrupts never nest.
+ */
+void interrupt_signals(sigset_t *set);
+
 #endif /* __INTERRUPTS_PRIVATE_H__ */
 
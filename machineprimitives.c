@@ -6,11 +6,14 @@
  *
  * YOU SHOULD NOT [NEED TO] MODIFY THIS FILE.
  */
+#include <sched.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/mman.h>
+#include <unistd.h>
 
 #include "defs.h"
+#include "interrupts.h"
 #include "minithread.h"
 #include "machineprimitives.h"
 
@@ -18,6 +21,7 @@ typedef struct initial_stack_state *initial_stack_state_t;
 
 struct initial_stack_state
 {
+  void *restore_proc;         /* pops the rest, see minithread_switch */
   void *body_proc;            /* v1 or ebx */
   void *body_arg;             /* v2 or edi */
   void *finally_proc;         /* v3 or esi */
@@ -40,34 +44,151 @@ static const int STACK_GROWS_DOWN      = 1;
 static const int STACKSIZE             = (256 * 1024);
 static const int STACKALIGN            = 0xf;
 
+/*
+ * Every stack is its own anonymous mapping, committed lazily by the kernel
+ * as the thread touches it, with an optional PROT_NONE guard page below it.
+ * This header takes the top bytes of the mapping, in the page the thread
+ * touches first, and is what the stack base handed out points to.
+ */
+typedef struct stack_header {
+    size_t size;                /* usable bytes, header included */
+    size_t guard;               /* bytes of guard below the stack */
+    struct stack_header *next;  /* next stack in the stack cache */
+} stack_header_t;
+
+static int stack_guard = 1;
+
+/*
+ * Cache of freed stacks. Stacks are reused most-recently-freed first, while
+ * their pages are still warm, and only for requests of the same size.
+ */
+static int stack_cache_max = 64;
+static int stack_cache_len = 0;
+static stack_header_t *stack_cache = NULL;
+
+/* Map a fresh stack of size bytes (a multiple of the page size) */
+static stack_header_t*
+stack_map(size_t size)
+{
+    size_t guard = stack_guard ? (size_t) sysconf(_SC_PAGESIZE) : 0;
+    stack_header_t *stack;
+    char *p;
+
+    p = mmap(NULL, size + guard, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (p == MAP_FAILED)
+        return NULL;
+    if (guard > 0 && mprotect(p, guard, PROT_NONE) == -1) {
+        munmap(p, size + guard);
+        return NULL;
+    }
+    stack = (stack_header_t *) (p + guard + size) - 1;
+    stack->size = size;
+    stack->guard = guard;
+    return stack;
+}
+
+static void
+stack_unmap(stack_header_t *stack)
+{
+    munmap((char *) (stack + 1) - stack->size - stack->guard,
+           stack->size + stack->guard);
+}
+
+void
+minithread_set_stack_guard(int enabled)
+{
+    stack_guard = enabled;
+}
+
+void
+minithread_set_stack_cache(int max_stacks)
+{
+    stack_header_t *stack;
+    interrupt_level_t old_level;
+
+    if (max_stacks < 0)
+        max_stacks = 0;
+    old_level = set_interrupt_level(DISABLED);
+    stack_cache_max = max_stacks;
+    while (stack_cache_len > stack_cache_max) {
+        stack = stack_cache;
+        stack_cache = stack->next;
+        stack_cache_len--;
+        stack_unmap(stack);
+    }
+    set_interrupt_level(old_level);
+}
+
 void
 minithread_allocate_stack(stack_pointer_t *stackbase, stack_pointer_t *stacktop)
 {
-    *stackbase = (stack_pointer_t) malloc(STACKSIZE);
+    minithread_allocate_stack_size(stackbase, stacktop, STACKSIZE);
+}
+
+void
+minithread_allocate_stack_size(stack_pointer_t *stackbase,
+                               stack_pointer_t *stacktop, int size)
+{
+    size_t page = (size_t) sysconf(_SC_PAGESIZE);
+    stack_header_t *stack, **prev;
+    interrupt_level_t old_level;
+
+    if (size <= 0)
+        size = STACKSIZE;
+    size = (size + page - 1) & ~(page - 1);
+
+    old_level = set_interrupt_level(DISABLED);
+    for (prev = &stack_cache; *prev != NULL; prev = &((*prev)->next)) {
+        if ((*prev)->size == size)
+            break;
+    }
+    stack = *prev;
+    if (stack != NULL) {
+        *prev = stack->next;
+        stack_cache_len--;
+    }
+    set_interrupt_level(old_level);
+
+    if (stack == NULL)
+        stack = stack_map(size);
+    *stackbase = (stack_pointer_t) stack;
     if (!*stackbase)  {
+        *stacktop = NULL;
         return;
     }
 
     if (STACK_GROWS_DOWN)
-      /* Stacks grow down, but malloc grows up. Compensate and word align
-         (turn off low 2 bits by anding with ~3). */
-      *stacktop = (stack_pointer_t) ((long)((char*)*stackbase + STACKSIZE - 1) & ~STACKALIGN);
+      /* Grow down from just below the header. Word align
+         (turn off low 4 bits by anding with ~0xf). */
+      *stacktop = (stack_pointer_t) ((long)((char*)stack - 1) & ~STACKALIGN);
     else {
-      /* Word align (turn off low 2 bits by anding with ~3) */
-      *stacktop = (stack_pointer_t)(((long)*stackbase + 3)&~STACKALIGN);
+      /* Grow up from the bottom of the mapping */
+      *stacktop = (stack_pointer_t) ((char*)(stack + 1) - size);
     }
 }
 
 void
 minithread_free_stack(stack_pointer_t stackbase)
 {
-    free(stackbase);
+    stack_header_t *stack = (stack_header_t *) stackbase;
+    interrupt_level_t old_level = set_interrupt_level(DISABLED);
+    if (stack_cache_len < stack_cache_max) {
+        stack->next = stack_cache;
+        stack_cache = stack;
+        stack_cache_len++;
+        stack = NULL;
+    }
+    set_interrupt_level(old_level);
+    if (stack != NULL)
+        stack_unmap(stack);
 }
 
 /*
  * See the architecture assembly file.
  */
 extern int minithread_root();
+extern void minithread_restore_full();
 
 void
 minithread_initialize_stack(
@@ -93,5 +214,43 @@ minithread_initialize_stack(
     ss->finally_proc = (void *) finally_proc;
     ss->finally_arg = (void *) finally_arg;
 
+    ss->restore_proc = (void *) minithread_restore_full;
     ss->root_proc = (void *) minithread_root;
 }
+
+/*
+ * Waiting for a spinlock spins with pause for up to SPINLOCK_SPINS reads of
+ * it, then yields the host CPU on every read after that. The holder is a
+ * host thread too, and when there are more virtual CPUs than host CPUs it
+ * may not be running at all until the waiters give way.
+ */
+#define SPINLOCK_SPINS 128
+
+void
+spinlock_acquire(tas_lock_t *l)
+{
+    int spins = 0;
+
+    while (atomic_test_and_set(l)) {
+        while (*((volatile tas_lock_t *) l)) {
+            if (spins < SPINLOCK_SPINS) {
+                spins++;
+                __builtin_ia32_pause();
+            } else {
+                sched_yield();
+            }
+        }
+    }
+}
+
+int
+spinlock_try(tas_lock_t *l)
+{
+    return *((volatile tas_lock_t *) l) == 0 && atomic_test_and_set(l) == 0;
+}
+
+void
+spinlock_release(tas_lock_t *l)
+{
+    atomic_clear(l);
+}
@@ -37,23 +37,54 @@ typedef int (*proc_t)(arg_t); /* generic function pointer */
 void minithread_allocate_stack(stack_pointer_t *stackbase,
                                       stack_pointer_t *stacktop);
 
+/*
+ * Like minithread_allocate_stack, but the stack is size bytes, rounded up to
+ * whole pages; size <= 0 selects the default size (256 KB). Stacks are
+ * mmap'd and committed lazily, so a mostly idle thread only costs the pages
+ * it has touched, and each stack has a guard page below it that turns an
+ * overflow into a fault.
+ */
+void minithread_allocate_stack_size(stack_pointer_t *stackbase,
+                                    stack_pointer_t *stacktop, int size);
+
 /*
  * minithread_free_stack(stack_pointer_t stackbase)
  *
  * Frees the stack at stackbase.  Care should be taken to ensure that the stack
- * is not in use when it is freed.
+ * is not in use when it is freed.  Freed stacks are kept in a cache and handed
+ * out again by minithread_allocate_stack, up to the limit set with
+ * minithread_set_stack_cache.
  */
 void minithread_free_stack(stack_pointer_t stackbase);
 
+/*
+ * minithread_set_stack_cache(int max_stacks)
+ *
+ * Keep at most max_stacks freed stacks for reuse (default 64); 0 disables the
+ * cache. Stacks beyond the new limit are released immediately.
+ */
+void minithread_set_stack_cache(int max_stacks);
+
+/*
+ * minithread_set_stack_guard(int enabled)
+ *
+ * Give stacks allocated from now on a guard page (default on). A guarded
+ * stack takes two kernel memory mappings, so running more threads than
+ * half of vm.max_map_count requires turning guards off.
+ */
+void minithread_set_stack_guard(int enabled);
+
 /*
  *  Initialize the stackframe pointed to by *stacktop so that
  *  the thread running off of *stacktop will invoke:
- *      body_proc(body_arg);
- *      final_proc(final_arg);
+ *      ret = body_proc(body_arg);
+ *      final_proc(final_arg, ret);
  *
  *  The call to final_proc should be used for cleanup, since it is called
- *  when body_proc returns.  final_proc should not return; doing so will
- *  lead to undefined behavior and likely cause your system to crash.
+ *  when body_proc returns. final_proc gets the value body_proc returned as
+ *  a second argument, so it may be declared int final_proc(arg_t, int).
+ *  final_proc should not return; doing so will lead to undefined behavior
+ *  and likely cause your system to crash.
  *
  *  body_proc and final_proc cannot be NULL. Passing invalid
  *      function pointers crashes the system.
@@ -87,6 +118,30 @@ void minithread_trampoline(proc_t interrupt, void * arg);
 void minithread_switch(stack_pointer_t *old_thread_sp,
                        stack_pointer_t *new_thread_sp);
 
+/*
+ * Called by both switch primitives on the new thread's stack, before its
+ * registers are reloaded. It enables interrupts and releases what the
+ * scheduler held across the switch. Defined by the threads package.
+ */
+void minithread_switch_finish();
+
+/*
+ * Like minithread_switch, but only saves the registers the C calling
+ * convention requires a called function to preserve (rbx, rbp, r12-r15).
+ * Enough for a thread that gives up the CPU through a function call, such
+ * as semaphore_P or minithread_yield; minithread_switch remains for
+ * preemption. Threads switched out either way can be resumed by either.
+ */
+void minithread_switch_fast(stack_pointer_t *old_thread_sp,
+                            stack_pointer_t *new_thread_sp);
+
+/*
+ * Read the processor cycle counter. Much cheaper than reading a clock, for
+ * timestamps on hot paths; the cycle rate has to be measured against a
+ * clock to turn cycles into time.
+ */
+uint64_t minithread_cycles();
+
 /* SYNCHRONIZATION PRIMITIVES */
 
 /*
@@ -113,6 +168,15 @@ int swap(int* x, int newval);
  */
 int compare_and_swap(int* x, int oldval, int newval);
 
+/*
+ * Spinlocks on a test-and-set lock, which starts out 0. Hold one only with
+ * interrupts disabled, since an interrupt handler may want it too.
+ * spinlock_try takes the lock only if it is free, and returns 1 if it did.
+ */
+void spinlock_acquire(tas_lock_t *l);
+int spinlock_try(tas_lock_t *l);
+void spinlock_release(tas_lock_t *l);
+
 /*
  * Returns the current time in milliseconds
  *    To be used only for timings - your OS should keep track of its
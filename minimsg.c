@@ -2,6 +2,7 @@
  *  Implementation of minimsgs and miniports.
  */
 
+#include <stddef.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
@@ -33,6 +34,7 @@ struct miniport {
 
 struct minimessage {
     int size;
+    node_t link;        // link in the incoming_data queue of a port
     char buffer[MAX_NETWORK_PKT_SIZE];
 };
 
@@ -56,7 +58,8 @@ miniport_t* miniport_create_unbound(int port_number) {
         assert(ports[port_number] != NULL);
         ports[port_number] -> port_number = port_number;
         ports[port_number] -> type = UNBOUND_PORT;
-        ports[port_number] -> unbound.incoming_data = queue_new();
+        ports[port_number] -> unbound.incoming_data = 
+            queue_new_intrusive(offsetof(minimessage_t, link));
         ports[port_number] -> unbound.datagrams_ready = semaphore_create();
 
         // Fail to create queue or semaphore
@@ -153,6 +156,7 @@ int minimsg_receive(miniport_t* local_unbound_port, miniport_t** new_local_bound
 
     // Strip header
     memcpy(msg, minimsg -> buffer + sizeof(mini_header_t), *len);
+    free(minimsg);
     set_interrupt_level(old_level);
     return 0;
 }
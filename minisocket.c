@@ -2,6 +2,8 @@
  *  Implementation of minisockets.
  */
 
+#include <stddef.h>
+
 #include "alarm.h"
 #include "minisocket.h"
 #include "minimsg.h"
@@ -14,7 +16,8 @@
 
 #define MAX_PORT_NUMBER 65535
 #define CLIENT_PORT_START 32768 
-#define INITIAL_TIMEOUT 0.1
+#define INITIAL_TIMEOUT 0.01    // seconds, a LAN round trip with room to spare
+#define MAX_TIMEOUT 6.4         // doubles up to this, then gives up
 #define RELIABLE_HDR_LEN sizeof(mini_header_reliable_t)
 #define MAX_TCP_MSG MAX_NETWORK_PKT_SIZE - RELIABLE_HDR_LEN
 #define START_BUF_SIZE 100
@@ -36,6 +39,7 @@ struct minisocket {
 
 struct minimessage {
     int size;
+    node_t link;        // link in the incoming_data queue of a socket
     char buffer[MAX_TCP_MSG];
 };
 
@@ -71,23 +75,25 @@ mini_header_reliable_t* pack_header(minisocket_t *socket, char message_type, min
 }
 
 // Send message with timeout. Return size of packet successfully delivered or -1 when failure 
-int send_message(minisocket_t *socket, mini_header_reliable_t *header, int msg_len, char *msg, minisocket_error* error) {
+int send_message(minisocket_t *socket, mini_header_reliable_t *header, int msg_len, const char *msg, minisocket_error* error) {
     double timeout = INITIAL_TIMEOUT;
     interrupt_level_t old_level = set_interrupt_level(DISABLED);
-    while (timeout <= 6.4) {
+    while (timeout <= MAX_TIMEOUT) {
         int sent_size = network_send_pkt(socket->remote_address, RELIABLE_HDR_LEN, (char*) header, msg_len, msg);
-        alarm_id a = alarm_register(timeout * SECOND / MILLISECOND, (void (*)(void *))semaphore_V, socket-> ack_ready);
+        alarm_id a = alarm_register_ns(timeout * SECOND, (void (*)(void *))semaphore_V, socket-> ack_ready);
         // putting thread on wait queue for port
         semaphore_P(socket->ack_ready);
+        alarm_deregister(a);
         
         if (socket->message_type == MSG_FIN && socket->status == SEND_SYN) {
             *error = SOCKET_BUSY;
+            set_interrupt_level(old_level);
             return -1;
         }
 
         // Received ACK
         if (socket->incoming_ack == socket->seq_number) {
-            alarm_deregister(a);
+            set_interrupt_level(old_level);
             return sent_size - RELIABLE_HDR_LEN;
         }
         timeout *= 2;
@@ -106,8 +112,7 @@ void minisocket_destroy(minisocket_t *socket) {
     semaphore_destroy(socket->ack_ready);
     semaphore_destroy(socket->datagrams_ready);
     while (queue_length(socket->incoming_data) > 0) {
-         minimessage_t *minimsg = (minimessage_t *) malloc(sizeof(minimessage_t));
-        assert(minimsg != NULL);
+        minimessage_t *minimsg;
         int ret = queue_dequeue(socket->incoming_data, (void **) &minimsg);
         assert(ret != -1);
         //free(minimsg->buffer);
@@ -157,7 +162,7 @@ minisocket_t* minisocket_server_create(int port, minisocket_error *error) {
     sockets[port]->local_port_number = port;
     network_address_copy(host_address, sockets[port]->local_address);
 
-    sockets[port]->incoming_data = queue_new();
+    sockets[port]->incoming_data = queue_new_intrusive(offsetof(minimessage_t, link));
     sockets[port]->ack_ready = semaphore_create();
     sockets[port]->datagrams_ready = semaphore_create();
     
@@ -181,8 +186,10 @@ minisocket_t* minisocket_server_create(int port, minisocket_error *error) {
         sockets[port]->seq_number++; 
         mini_header_reliable_t *header;
         header = pack_header(sockets[port], MSG_SYNACK, error);
-        if (header == NULL) 
+        if (header == NULL) {
+            set_interrupt_level(old_level);
             return NULL; 
+        }
         sockets[port]->status = SEND_SYNACK;
         int ret = send_message(sockets[port], header, 0, "", error);
         if (ret != -1) {
@@ -227,7 +234,7 @@ minisocket_t* minisocket_client_create(const network_address_t addr, int port, m
     network_address_copy(host_address, socket->local_address);
     socket->remote_port_number = port;
     network_address_copy(addr, socket->remote_address);
-    socket->incoming_data = queue_new();
+    socket->incoming_data = queue_new_intrusive(offsetof(minimessage_t, link));
     socket->ack_ready = semaphore_create();
     socket->datagrams_ready = semaphore_create();
     // Fail to create queue or semaphore
@@ -235,6 +242,7 @@ minisocket_t* minisocket_client_create(const network_address_t addr, int port, m
         || socket->datagrams_ready == NULL) {
         minisocket_destroy(socket);
         *error = SOCKET_OUTOFMEMORY;
+        set_interrupt_level(old_level);
         return NULL;
     }
     semaphore_initialize(socket->ack_ready, 0);
@@ -244,11 +252,14 @@ minisocket_t* minisocket_client_create(const network_address_t addr, int port, m
     // send SYN
     mini_header_reliable_t *header;
     header = pack_header(socket, MSG_SYN, error);
-    if (header == NULL) 
+    if (header == NULL) {
+        set_interrupt_level(old_level);
         return NULL;
+    }
     socket->status = SEND_SYN;
     int ret = send_message(socket, header, 0, "", error);
     if (ret == -1) {
+        set_interrupt_level(old_level);
         return NULL;
     }
 
@@ -276,9 +287,8 @@ int minisocket_send(minisocket_t *socket, const char *msg, int len, minisocket_e
         return -1;
     }
 
+    // Fragments go out straight from msg, after their header
     int max_tcp_msg = MAX_TCP_MSG, total_sent = 0, ret;
-    char tmp_msg[len];
-    memcpy(tmp_msg, msg, len);
     mini_header_reliable_t *header;
     interrupt_level_t old_level = set_interrupt_level(DISABLED);
     
@@ -288,18 +298,18 @@ int minisocket_send(minisocket_t *socket, const char *msg, int len, minisocket_e
         socket -> status = DATA_SENT;
         header = pack_header(socket, MSG_ACK, error);
         if (header == NULL) 
-            return -1; 
+            break; 
         if (len > max_tcp_msg) {
             // Message can't fit in one packet
-            ret = send_message(socket, header, max_tcp_msg, tmp_msg + total_sent, error);
+            ret = send_message(socket, header, max_tcp_msg, msg + total_sent, error);
             if (ret == -1)
-                return total_sent;
+                break;
             total_sent += ret; 
             len = len - ret;
         } else {
-            ret = send_message(socket, header, len, tmp_msg + total_sent, error);
+            ret = send_message(socket, header, len, msg + total_sent, error);
             if (ret == -1)
-                return total_sent;
+                break;
             total_sent += ret;
             break;
         }   
@@ -320,11 +330,7 @@ int minisocket_receive(minisocket_t *socket, char *msg, int max_len, minisocket_
         return -1;
     }
 
-    minimessage_t *minimsg = (minimessage_t *) malloc(sizeof(minimessage_t));
-    if (minimsg == NULL) {
-        *error = SOCKET_OUTOFMEMORY;
-        return -1;
-     }
+    minimessage_t *minimsg;
 
     // Wait for new message to arrive
     int size, ret;
@@ -340,16 +346,21 @@ int minisocket_receive(minisocket_t *socket, char *msg, int max_len, minisocket_
             mini_header_reliable_t *header;
             socket -> status = SEND_FINACK;
             header = pack_header(socket, MSG_FINACK, error);
-            if (header == NULL) 
+            if (header == NULL) {
+                set_interrupt_level(old_level);
                 return -1;
+            }
             network_send_pkt(socket -> remote_address, RELIABLE_HDR_LEN, (char *) header, 0, "");
             minisocket_destroy(socket);
+            set_interrupt_level(old_level);
             return 0;
         } else if (socket -> message_type == MSG_SYN) {
             mini_header_reliable_t *header;
             header = pack_header(socket, MSG_FIN, error);
-            if (header == NULL) 
+            if (header == NULL) {
+                set_interrupt_level(old_level);
                 return -1;
+            }
             network_send_pkt(socket -> remote_address, RELIABLE_HDR_LEN, (char *) header, 0, "");
             true_data = 0;
         }
@@ -397,8 +408,9 @@ void minisocket_append(network_interrupt_arg_t* packet) {
     minimsg -> size = packet -> size - RELIABLE_HDR_LEN;
     memcpy(minimsg -> buffer, (packet -> buffer) + RELIABLE_HDR_LEN , minimsg -> size);
     int port_number = unpack_unsigned_short(header -> destination_port);
-    if (port_number < 0 || port_number > MAX_PORT_NUMBER) {
+    if (port_number < 0 || port_number >= MAX_PORT_NUMBER) {
         free(minimsg);
+        set_interrupt_level(old_level);
         return;
     }
     minisocket_t *socket = sockets[port_number];
@@ -1,128 +1,952 @@
+
 #include <assert.h>
+#include <pthread.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include "alarm.h"
 #include "interrupts.h"
 #include "minithread.h" 
 #include "miniheader.h"
 #include "minimsg.h"
 #include "minisocket.h"
-#include "multilevel_queue.h"
 #include "network.h" 
 #include "queue.h"
+#include "scheduler.h"
 #include "synch.h"
+#include "trace.h"
+
+/* 
+ * Share of a thread group on one CPU. The group's threads ready on the CPU
+ * wait in rq, and while there are any, the group waits in the group tree of
+ * the CPU, ordered by its virtual runtime as under cfs. The group running
+ * on the CPU stays off the tree, so a CPU with one group busy never touches
+ * it.
+ */
+typedef struct group_cpu {
+    sched_entity_t se;          // node in the group tree, must come first
+    void *rq;                   // ready list, owned by the policy
+    int nready;                 // threads on it
+    int on_tree;
+    struct minithread_group *group;
+} group_cpu_t;
+
+/* Thread group definition, see minithread_group_create */
+struct minithread_group {
+    int threads;                // threads in it that did not exit
+    uint64_t cpu_time;          // times below are in cycles
+    uint64_t quota;             // CPU time per period, 0 for no limit
+    uint64_t period;
+    uint64_t used;              // CPU time in the current period
+    uint64_t period_end;
+    int throttled;              // out of quota until the period ends
+    uint64_t throttles;
+    alarm_id unthrottle;        // ends the period once out of quota
+    group_cpu_t percpu[];       // one per CPU
+};
 
 /* minithread control block definition */
 struct minithread {
     int tid;
-    int level;
-    int quantum_remain;
+    int cpu;                    // CPU the thread last ran on, -1 if never
+    int state;                  // THREAD_ONCPU and THREAD_WAKE
+    node_t link;                // link in a wait queue
+    sched_entity_t se;          // state of the scheduler policy
+    minithread_group_t *group;  // NULL for kernel threads
     stack_pointer_t stack_ptr;
-    stack_pointer_t stack_base;
+    stack_pointer_t stack_base;   // NULL once the thread exited and was reaped
+    int retval;                 // what proc returned
+    int exited;
+    int detached;               // free the thread when it is reaped
+    minithread_t *joiner;       // thread waiting in minithread_join
+
+    struct cpu *ready_cpu;      // whose ready list the thread is on, if any
+    int rt_ready;               // on its real-time ready list
+
+    // Real-time class, see minithread_set_deadline. Times are in cycles.
+    uint64_t rt_period;         // 0 unless the thread is real-time
+    uint64_t rt_budget;
+    uint64_t rt_runtime;        // budget left in the current period
+    int rt_done;                // slept since the current period began
+    int rt_cpu;                 // CPU whose real-time list it goes on
+    double rt_share;            // budget / period it was admitted with
+    alarm_id rt_replenish;      // begins the next period once out of budget
+    uint64_t jobs;
+    uint64_t deadline_misses;
+    // Priority inheritance, see minithread_inherit_level
+    struct mutex *mutex_waiting;
+    struct mutex *mutexes_held;
+
+    // Accounting, see minithread_stats
+    uint64_t ran_at;            // when it last got a CPU, in cycles
+    uint64_t enqueued_at;       // when it last became ready, in cycles
+    uint64_t cpu_time;          // times below are in cycles too
+    uint64_t voluntary_switches;
+    uint64_t involuntary_switches;
+    uint64_t wait_time[MINITHREAD_LEVELS];
 };
 
+/* 
+ * A thread is THREAD_ONCPU from when a CPU switches to it until that CPU
+ * has switched away from it, and so saved its registers. Once it stops, it
+ * may be woken before then: minithread_start marks it THREAD_WAKE instead
+ * of queueing it, and it goes on, or the CPU queues it once it is off.
+ */
+#define THREAD_ONCPU 1
+#define THREAD_WAKE 2
+
+/* 
+ * Virtual CPU definition. Each CPU is driven by one host thread and has its
+ * own ready list, running thread and idle (kernel) thread.
+ *
+ * The lock of a CPU guards its ready lists (and the counts and group tree
+ * that go with them) and its running thread. Scheduling on a CPU takes its
+ * lock, and stealing tries the victim's too; waking a thread takes the lock
+ * of the CPU it goes on. A CPU holds its lock across a context switch, and
+ * the thread switched to releases it in minithread_switch_finish.
+ *
+ * The budgets of real-time threads and the quotas of groups are kept with
+ * alarms, which need the kernel lock, so while there are any (budgeted > 0)
+ * scheduling takes the kernel lock before the CPU lock. Only a CPU holding
+ * the kernel lock waits for a CPU lock while it holds another, so no two
+ * wait for each other. Changing the class, level, weight or group of a
+ * thread, or throttling a group, locks every CPU.
+ */
+typedef struct cpu {
+    int id;
+    tas_lock_t lock;
+    struct cpu *owner;              // CPU holding lock, see minithread_lock
+    void *groups;                   // group tree, owned by sched_cfs
+    group_cpu_t *curr_group;        // group of the running thread
+    int ngroups;                    // groups on the group tree
+    int yielding;                   // the running thread is rescheduling
+    uint64_t group_min;             // virtual runtime of the last group run
+    void *rt;                       // real-time ready list
+    double rt_utilization;          // budget / period of threads it admitted
+    int nready;                     // threads on both, but throttled ones
+    int nrt;                        // threads on the real-time list
+    int need_resched;               // the running thread should give way
+    alarm_id budget_alarm;          // ends the budget of the running one
+    minithread_t *curr_thread;      // current running thread
+    minithread_t *k_thread;         // kernel (idle) thread
+    pthread_t host;                 // host thread driving this CPU
+    int sleeping;                   // blocked in minithread_clock_sleep
+    int preempting;                 // the clock handler is rescheduling
+    minithread_t *dead;             // exited thread whose stack is still in use
+    minithread_t *prev;             // thread last switched away from
+    // run-queue latency histograms, see minithread_stats
+    uint64_t latency[MINITHREAD_LEVELS][MINITHREAD_LATENCY_BUCKETS];
+} cpu_t;
+
 int next_tid = 1;               // next thread id to allocate
-int quantum = 160;              // total quantum for 1 cycle
-queue_t *f_list;                // finished list
-queue_t *alarm_list;            // alarm list
-multilevel_queue_t *rd_list;    // ready list
-minithread_t *curr_thread;      // current running thread
-minithread_t *k_thread;         // kernel thread
-minithread_t *cleanup_thread;   // cleanup thread
-semaphore_t *cleanup_sem;
+int ncpus = 1;                  // number of virtual CPUs
+cpu_t *cpus[MAX_CPUS];          // all virtual CPUs, cpus[0] is the main thread
+volatile int ready_threads = 0; // threads in all ready lists together
+volatile int sleeping_cpus = 0; // CPUs sleeping in the host
+volatile int budgeted = 0;      // real-time threads and groups with a quota
+sched_ops_t *sched = &sched_mlfq;   // scheduler policy
+minithread_group_t *default_group;  // group of threads nobody placed
 
 /* 
- * x == 1, added back to the queue, x == 0 otherwise
+ * CPU driven by the calling host thread. A minithread may resume on another
+ * CPU after any context switch, so never keep this across a switch.
  */
-void minithread_schedule(int x) {
-    interrupt_level_t old_level = set_interrupt_level(DISABLED);
-    minithread_t *next_thread;
-    curr_thread -> quantum_remain--;
-    quantum--;
-    int next_level = curr_thread -> level;
-    if (curr_thread -> quantum_remain == 0) {
-        // Level 3 will just enqueue at the end of the queue
-        if (curr_thread -> level != 3) {
-            next_level++;
-            curr_thread -> level = next_level;
+__thread cpu_t *this_cpu;
+
+/* 
+ * Lock cpu, unless this CPU holds its lock already. Return 1 if it was
+ * locked here, so the caller knows to unlock it. Interrupts must be
+ * disabled.
+ */
+static int minithread_lock(cpu_t *cpu) {
+    if (cpu -> owner == this_cpu)
+        return 0;
+    spinlock_acquire(&(cpu -> lock));
+    cpu -> owner = this_cpu;
+    return 1;
+}
+
+/* Lock cpu if its lock is free. Return 1 if it was locked */
+static int minithread_trylock(cpu_t *cpu) {
+    if (!spinlock_try(&(cpu -> lock)))
+        return 0;
+    cpu -> owner = this_cpu;
+    return 1;
+}
+
+static void minithread_unlock(cpu_t *cpu) {
+    cpu -> owner = NULL;
+    spinlock_release(&(cpu -> lock));
+}
+
+/* 
+ * Lock every CPU. Needs the kernel lock. Return the set of CPUs locked
+ * here, for minithread_unlock_all.
+ */
+static uint64_t minithread_lock_all() {
+    uint64_t locked = 0;
+    int i;
+
+    for (i = 0; i < ncpus; i++) {
+        if (minithread_lock(cpus[i]))
+            locked |= (uint64_t) 1 << i;
+    }
+    return locked;
+}
+
+static void minithread_unlock_all(uint64_t locked) {
+    int i;
+
+    for (i = 0; i < ncpus; i++) {
+        if (locked & ((uint64_t) 1 << i))
+            minithread_unlock(cpus[i]);
+    }
+}
+
+/* 
+ * Lock cpu to schedule there, taking the kernel lock first while anything
+ * is budgeted, or an alarm of a budget that ended is still to be cancelled.
+ */
+static void minithread_lock_sched(cpu_t *cpu) {
+    for (;;) {
+        if ((budgeted > 0 || cpu -> budget_alarm != NULL) && !kernel_locked())
+            set_interrupt_level(DISABLED);
+        minithread_lock(cpu);
+        if (kernel_locked() || (budgeted == 0 && cpu -> budget_alarm == NULL))
+            return;
+        // Budgeted meanwhile, and the kernel lock must come first
+        minithread_unlock(cpu);
+    }
+}
+
+/* 
+ * Wake a sleeping CPU to run a thread just queued on cpu: cpu itself if it
+ * sleeps, else any sleeping CPU, which will steal the thread.
+ */
+static void minithread_wake(cpu_t *cpu) {
+    int i;
+
+    for (i = 0; !cpu -> sleeping && i < ncpus; i++)
+        cpu = cpus[i];
+    if (cpu == this_cpu || compare_and_swap(&(cpu -> sleeping), 1, 0) != 1)
+        return;
+    __sync_fetch_and_sub(&sleeping_cpus, 1);
+    minithread_clock_wake(cpu -> host);
+}
+
+/* 
+ * Make the thread running on cpu give way: at the next interrupt if cpu is
+ * ours, else at once, by interrupting cpu. A sleeping CPU runs nothing.
+ */
+static void minithread_resched(cpu_t *cpu) {
+    cpu -> need_resched = 1;
+    if (cpu != this_cpu && !cpu -> sleeping)
+        minithread_clock_wake(cpu -> host);
+}
+
+/* Level t is queued at: its own, or a better one it inherited */
+static int minithread_effective_level(minithread_t *t, int level) {
+    return t -> se.inherited < level ? t -> se.inherited : level;
+}
+
+/* Whether t is in the real-time class: it has budget left in its period */
+static int minithread_rt(minithread_t *t) {
+    return t -> rt_period != 0 && t -> rt_runtime > 0;
+}
+
+/* 
+ * Begin a new period of real-time thread t at time now if it is due. A
+ * thread that woke up from a sleep begins one unless what is left of the
+ * current one still fits its bandwidth, as in a constant bandwidth server,
+ * so periods follow its wakeups. A thread that did not sleep before its
+ * deadline missed it.
+ */
+static void minithread_rt_refresh(minithread_t *t, uint64_t now) {
+    if (t -> rt_done) {
+        if (now < t -> se.deadline && t -> rt_runtime * t -> rt_period <=
+            (t -> se.deadline - now) * t -> rt_budget)
+            return;
+        t -> rt_done = 0;
+        t -> se.deadline = now + t -> rt_period;
+    } else {
+        if (now < t -> se.deadline)
+            return;
+        t -> deadline_misses++;
+        t -> se.deadline += t -> rt_period;
+        if (t -> se.deadline <= now)
+            t -> se.deadline = now + t -> rt_period;
+    }
+    t -> rt_runtime = t -> rt_budget;
+}
+
+/* Share of the group of t on cpu */
+static group_cpu_t* minithread_group_cpu(minithread_t *t, cpu_t *cpu) {
+    return &(t -> group -> percpu[cpu -> id]);
+}
+
+/* 
+ * Put gc on the group tree of cpu if it has threads ready and may run them.
+ * A group that was idle catches up with the others.
+ */
+static void minithread_group_queue(cpu_t *cpu, group_cpu_t *gc) {
+    if (gc -> on_tree || gc -> nready == 0 || gc -> group -> throttled ||
+        gc == cpu -> curr_group)
+        return;
+    if (gc -> se.key < cpu -> group_min)
+        gc -> se.key = cpu -> group_min;
+    sched_cfs.enqueue(cpu -> groups, &(gc -> se));
+    gc -> on_tree = 1;
+    cpu -> ngroups++;
+}
+
+static void minithread_group_unqueue(cpu_t *cpu, group_cpu_t *gc) {
+    if (gc -> on_tree) {
+        sched_cfs.remove(cpu -> groups, &(gc -> se));
+        gc -> on_tree = 0;
+        cpu -> ngroups--;
+    }
+}
+
+/* 
+ * Pick the group to run next on cpu, the one furthest behind its share:
+ * the first on the group tree, which is taken off it, or the running one.
+ * The running one counts as having a thread ready while its thread yields.
+ * Return NULL if no group has threads ready.
+ */
+static group_cpu_t* minithread_group_pick(cpu_t *cpu) {
+    group_cpu_t *curr = cpu -> curr_group;
+    group_cpu_t *gc = NULL;
+
+    if (curr != NULL && ((curr -> nready == 0 && !cpu -> yielding) ||
+                         curr -> group -> throttled))
+        curr = NULL;
+    if (cpu -> ngroups > 0)
+        gc = (group_cpu_t *) sched_cfs.pick_next(cpu -> groups);
+    if (gc == NULL) {
+        gc = curr;
+    } else if (curr != NULL && curr -> se.key <= gc -> se.key) {
+        sched_cfs.enqueue(cpu -> groups, &(gc -> se));
+        gc = curr;
+    } else {
+        gc -> on_tree = 0;
+        cpu -> ngroups--;
+    }
+    if (gc != NULL && gc -> se.key > cpu -> group_min)
+        cpu -> group_min = gc -> se.key;
+    return gc;
+}
+
+/* Whether t may run: it is not in a group that ran out of quota */
+static int minithread_runnable(minithread_t *t) {
+    return t -> group == NULL || !t -> group -> throttled;
+}
+
+/* 
+ * CPU whose ready list t goes on when queued on cpu: cpu, but for a
+ * real-time thread the CPU that admitted it. A real-time thread begins a
+ * new period first if one is due by t -> enqueued_at.
+ */
+static cpu_t* minithread_ready_cpu(cpu_t *cpu, minithread_t *t) {
+    if (t -> rt_period != 0)
+        minithread_rt_refresh(t, t -> enqueued_at);
+    return minithread_rt(t) ? cpus[t -> rt_cpu] : cpu;
+}
+
+/* 
+ * Enqueue t onto the ready list of cpu, see minithread_ready_cpu, locking
+ * that CPU unless this CPU holds it. Real-time threads go on the real-time
+ * list, and preempt the thread running there at once if it has a later
+ * deadline: a remote CPU is interrupted. Others go on the ready list of
+ * their group, and are not counted as ready while it is out of quota.
+ */
+static void minithread_enqueue(cpu_t *cpu, minithread_t *t) {
+    minithread_t *curr;
+    group_cpu_t *gc;
+    int locked;
+
+    cpu = minithread_ready_cpu(cpu, t);
+    locked = minithread_lock(cpu);
+    curr = cpu -> curr_thread;
+    t -> ready_cpu = cpu;
+    if (minithread_rt(t)) {
+        sched_edf.enqueue(cpu -> rt, &(t -> se));
+        t -> rt_ready = 1;
+        cpu -> nrt++;
+        if (!minithread_rt(curr) || curr -> se.deadline > t -> se.deadline)
+            minithread_resched(cpu);
+    } else {
+        gc = minithread_group_cpu(t, cpu);
+        sched -> enqueue(gc -> rq, &(t -> se));
+        gc -> nready++;
+        if (gc -> group -> throttled) {
+            if (locked)
+                minithread_unlock(cpu);
+            return;
         }
+        minithread_group_queue(cpu, gc);
+    }
+    cpu -> nready++;
+    __sync_fetch_and_add(&ready_threads, 1);
+    if (sleeping_cpus > 0)
+        minithread_wake(cpu);
+    if (locked)
+        minithread_unlock(cpu);
+}
+
+/* 
+ * Dequeue the thread to run next from the ready list of cpu: the real-time
+ * thread of the earliest deadline (unless rt is 0), else the one the policy
+ * picks from the group furthest behind its share. That group is left off
+ * the group tree, since it runs next; minithread_steal puts it back. Return
+ * NULL if the ready list is empty, or if the group of a yielding thread is
+ * picked and has no other thread ready, so the yielding one goes on.
+ */
+static minithread_t* minithread_dequeue(cpu_t *cpu, int rt) {
+    sched_entity_t *se = rt ? sched_edf.pick_next(cpu -> rt) : NULL;
+    group_cpu_t *gc;
+    minithread_t *t;
 
-        // Update quantum to 2^i, where i is level 
-        curr_thread -> quantum_remain = 1 << next_level;
-    }       
+    if (se != NULL) {
+        cpu -> nrt--;
+    } else {
+        if ((gc = minithread_group_pick(cpu)) == NULL || gc -> nready == 0)
+            return NULL;
+        se = sched -> pick_next(gc -> rq);
+        gc -> nready--;
+    }
+    t = (minithread_t *) ((char *) se - offsetof(minithread_t, se));
+    t -> ready_cpu = NULL;
+    t -> rt_ready = 0;
+    cpu -> nready--;
+    __sync_fetch_and_sub(&ready_threads, 1);
+    return t;
+}
 
-    if (multilevel_queue_length(rd_list) == 0) {
-        if (quantum == 0)
-            quantum = 160;
+/* Take t off the ready list of cpu. Return 0, or -1 if it is not there */
+static int minithread_unqueue(cpu_t *cpu, minithread_t *t) {
+    group_cpu_t *gc;
 
-        // Switch to kernel thread
-        minithread_switch(&(curr_thread -> stack_ptr), &(k_thread -> stack_ptr));
+    if (t -> rt_ready) {
+        if (sched_edf.remove(cpu -> rt, &(t -> se)) == -1)
+            return -1;
+        t -> rt_ready = 0;
+        cpu -> nrt--;
+    } else {
+        gc = minithread_group_cpu(t, cpu);
+        if (sched -> remove(gc -> rq, &(t -> se)) == -1)
+            return -1;
+        if (--gc -> nready == 0)
+            minithread_group_unqueue(cpu, gc);
+        if (gc -> group -> throttled) {
+            t -> ready_cpu = NULL;
+            return 0;
+        }
+    }
+    t -> ready_cpu = NULL;
+    cpu -> nready--;
+    __sync_fetch_and_sub(&ready_threads, 1);
+    return 0;
+}
+
+/* 
+ * The CPU other than cpu with the most threads ready that it may steal, or
+ * NULL if none has any. Real-time threads stay on the CPU that admitted
+ * them. Read without locks, so only a hint.
+ */
+static cpu_t* minithread_victim(cpu_t *cpu) {
+    cpu_t *victim = NULL;
+    int i, len, max_len = 0;
+
+    for (i = 0; i < ncpus; i++) {
+        len = cpus[i] -> nready - cpus[i] -> nrt;
+        if (cpus[i] != cpu && len > max_len) {
+            max_len = len;
+            victim = cpus[i];
+        }
+    }
+    return victim;
+}
+
+/* 
+ * Move one ready thread from the CPU with the longest ready list to cpu,
+ * which must be locked. A victim that is locked is left alone, since its
+ * CPU may be stealing from us. Return 0 on success, -1 if no other CPU had
+ * anything to run.
+ */
+static int minithread_steal(cpu_t *cpu) {
+    cpu_t *victim = minithread_victim(cpu);
+    minithread_t *t = NULL;
+
+    if (victim == NULL || !minithread_trylock(victim))
+        return -1;
+    if (victim -> nready - victim -> nrt > 0 &&
+        (t = minithread_dequeue(victim, 0)) != NULL) {
+        // Its group goes back on the group tree of victim if it has others
+        minithread_group_queue(victim, minithread_group_cpu(t, victim));
+        minithread_enqueue(cpu, t);
+    }
+    minithread_unlock(victim);
+    return t != NULL ? 0 : -1;
+}
+
+/* A CPU is idle when it runs its kernel thread and has nothing queued */
+static int minithread_cpu_idle(cpu_t *cpu) {
+    return cpu -> curr_thread == cpu -> k_thread && cpu -> nready == 0;
+}
+
+/*
+ * Choose the CPU a thread that becomes runnable is queued on: the CPU it last
+ * ran on if that CPU is idle, else any idle CPU, else the CPU it last ran on,
+ * else the CPU with the shortest ready list.
+ */
+static cpu_t* minithread_pick_cpu(minithread_t *t) {
+    cpu_t *best = NULL;
+    int i;
+
+    if (t -> cpu >= 0 && minithread_cpu_idle(cpus[t -> cpu]))
+        return cpus[t -> cpu];
+    for (i = 0; i < ncpus; i++) {
+        if (minithread_cpu_idle(cpus[i]))
+            return cpus[i];
+    }
+    if (t -> cpu >= 0)
+        return cpus[t -> cpu];
+    for (i = 0; i < ncpus; i++) {
+        if (best == NULL || cpus[i] -> nready < best -> nready)
+            best = cpus[i];
+    }
+    return best;
+}
+
+/* 
+ * Accounting takes timestamps with minithread_cycles, which costs a fraction
+ * of a clock read, and converts at this rate measured at startup.
+ */
+static double ns_per_cycle = 1.0;
+
+static void minithread_calibrate_cycles() {
+    uint64_t start_ns = minithread_clock_now(), end_ns;
+    uint64_t start = minithread_cycles();
+    do {
+        end_ns = minithread_clock_now();
+    } while (end_ns - start_ns < 2 * MILLISECOND);
+    ns_per_cycle = (double) (end_ns - start_ns) / (minithread_cycles() - start);
+}
+
+/* Clear the accounting of a new thread */
+static void minithread_account_init(minithread_t *t) {
+    t -> ran_at = t -> enqueued_at = minithread_cycles();
+    t -> cpu_time = 0;
+    t -> voluntary_switches = t -> involuntary_switches = 0;
+    memset(t -> wait_time, 0, sizeof(t -> wait_time));
+}
+
+/* 
+ * Account for a switch at time now from prev to next, which waited in the
+ * ready list at level (-1 if it was not in the ready list).
+ */
+static void minithread_account(cpu_t *cpu, minithread_t *prev, 
+                               minithread_t *next, int level, 
+                               int preempted, uint64_t now) {
+    uint64_t wait;
+    int bucket;
+
+    prev -> cpu_time += now - prev -> ran_at;
+    if (preempted)
+        prev -> involuntary_switches++;
+    else
+        prev -> voluntary_switches++;
+    next -> ran_at = now;
+    if (level < 0)
+        return;
+
+    wait = now - next -> enqueued_at;
+    next -> wait_time[level] += wait;
+    wait = wait * ns_per_cycle;
+    bucket = wait == 0 ? 0 : 63 - __builtin_clzll(wait);
+    if (bucket >= MINITHREAD_LATENCY_BUCKETS)
+        bucket = MINITHREAD_LATENCY_BUCKETS - 1;
+    cpu -> latency[level][bucket]++;
+}
+
+/* 
+ * Free the stack of the thread that last exited on cpu, which is safe once
+ * cpu switched away from it. The thread itself goes too if nobody can join
+ * it any more.
+ */
+static void minithread_reap(cpu_t *cpu) {
+    minithread_t *t = cpu -> dead;
+
+    if (t == NULL)
+        return;
+    cpu -> dead = NULL;
+    // A thread that may still be joined is freed by whichever of us and
+    // minithread_join comes last, which the kernel lock tells apart
+    if (!t -> detached)
+        set_interrupt_level(DISABLED);
+    minithread_free_stack(t -> stack_base);
+    t -> stack_base = NULL;
+    if (t -> detached)
+        free(t);
+}
+
+/* Alarm handler: the thread running on cpu used up its budget */
+static void minithread_budget_expire(void *cpu) {
+    minithread_resched((cpu_t *) cpu);
+}
+
+/* 
+ * Alarm handler: the period in which real-time thread t ran out of budget
+ * is over. Begin the next one, and move t back to the real-time list.
+ */
+static void minithread_rt_replenish(void *arg) {
+    minithread_t *t = (minithread_t *) arg;
+    uint64_t locked = minithread_lock_all();
+    cpu_t *cpu = t -> ready_cpu;
+
+    minithread_rt_refresh(t, minithread_cycles());
+    if (cpu != NULL && !t -> rt_ready && minithread_rt(t) &&
+        minithread_unqueue(cpu, t) == 0)
+        minithread_enqueue(cpu, t);
+    minithread_unlock_all(locked);
+}
+
+/* 
+ * Charge real-time thread t for ran cycles at time now. Out of budget, it
+ * runs in the policy until its deadline, when an alarm replenishes it.
+ */
+static void minithread_rt_charge(minithread_t *t, uint64_t ran, uint64_t now) {
+    uint64_t delay = 0;
+
+    if (!minithread_rt(t))
+        return;
+    if (ran < t -> rt_runtime) {
+        t -> rt_runtime -= ran;
+        return;
+    }
+    t -> rt_runtime = 0;
+    if (t -> se.deadline > now)
+        delay = (t -> se.deadline - now) * ns_per_cycle;
+    if (t -> rt_replenish != NULL)
+        alarm_deregister(t -> rt_replenish);
+    // Round up, so the deadline has passed when the alarm goes off
+    t -> rt_replenish = alarm_register_ns(delay + MICROSECOND,
+                                          minithread_rt_replenish, t);
+}
+
+/* 
+ * Alarm handler: the period in which group g ran out of quota is over.
+ * Begin the next one, and count its ready threads as ready again. Time it
+ * ran over its quota, as threads on other CPUs notice only at their next
+ * interrupt, is paid back first, so it may stay throttled for more periods.
+ */
+static void minithread_group_unthrottle(void *arg) {
+    minithread_group_t *g = (minithread_group_t *) arg;
+    uint64_t now = minithread_cycles();
+    group_cpu_t *gc;
+    uint64_t locked;
+    int i;
+
+    if (!g -> throttled)
+        return;
+    g -> used = g -> used > g -> quota ? g -> used - g -> quota : 0;
+    g -> period_end = now + g -> period;
+    if (g -> quota != 0 && g -> used >= g -> quota) {
+        if (g -> unthrottle != NULL)
+            alarm_deregister(g -> unthrottle);
+        g -> unthrottle = alarm_register_ns(g -> period * ns_per_cycle,
+                                            minithread_group_unthrottle, g);
+        return;
+    }
+    locked = minithread_lock_all();
+    g -> throttled = 0;
+    for (i = 0; i < ncpus; i++) {
+        gc = &(g -> percpu[i]);
+        cpus[i] -> nready += gc -> nready;
+        __sync_fetch_and_add(&ready_threads, gc -> nready);
+        minithread_group_queue(cpus[i], gc);
+        if (gc -> nready > 0 && sleeping_cpus > 0)
+            minithread_wake(cpus[i]);
+    }
+    minithread_unlock_all(locked);
+}
+
+/* 
+ * Stop running the threads of group g, which ran out of quota at time now,
+ * until its period ends. Ones running on other CPUs stop at their next
+ * interrupt.
+ */
+static void minithread_group_throttle(minithread_group_t *g, uint64_t now) {
+    uint64_t locked = minithread_lock_all();
+    group_cpu_t *gc;
+    int i;
+
+    g -> throttled = 1;
+    g -> throttles++;
+    for (i = 0; i < ncpus; i++) {
+        gc = &(g -> percpu[i]);
+        minithread_group_unqueue(cpus[i], gc);
+        cpus[i] -> nready -= gc -> nready;
+        __sync_fetch_and_sub(&ready_threads, gc -> nready);
+        if (cpus[i] -> curr_group == gc)
+            cpus[i] -> need_resched = 1;
+    }
+    minithread_unlock_all(locked);
+    if (g -> unthrottle != NULL)
+        alarm_deregister(g -> unthrottle);
+    // Round up, so the period is over when the alarm goes off
+    g -> unthrottle = alarm_register_ns((g -> period_end - now) * ns_per_cycle
+                                        + MICROSECOND,
+                                        minithread_group_unthrottle, g);
+}
+
+/* Charge group g for ran cycles of CPU time at time now */
+static void minithread_group_charge(minithread_group_t *g, uint64_t ran,
+                                    uint64_t now) {
+    // Other CPUs may charge g at the same time without the kernel lock,
+    // which they only do while it has no quota
+    __sync_fetch_and_add(&(g -> cpu_time), ran);
+    if (g -> quota == 0 || g -> throttled)
         return;
+    if (now >= g -> period_end) {
+        g -> used = 0;
+        g -> period_end = now + g -> period;
+    }
+    g -> used += ran;
+    if (g -> used >= g -> quota)
+        minithread_group_throttle(g, now);
+}
+
+/* 
+ * Charge the group running on cpu and its thread curr for a turn of ran
+ * cycles ending at time now. Called on every reschedule, before picking.
+ */
+static void minithread_group_tick(cpu_t *cpu, minithread_t *curr,
+                                  uint64_t ran, int blocked, uint64_t now) {
+    group_cpu_t *gc = cpu -> curr_group;
+
+    if (gc == NULL)
+        return;
+    sched -> tick(gc -> rq, &(curr -> se), ran * ns_per_cycle, blocked);
+    sched_cfs.tick(cpu -> groups, &(gc -> se), ran * ns_per_cycle, 0);
+    minithread_group_charge(gc -> group, ran, now);
+}
+
+/* 
+ * Make the group of next the one running on cpu, which keeps it off the
+ * group tree. The group that ran before goes back on it if it has threads
+ * ready.
+ */
+static void minithread_group_run(cpu_t *cpu, minithread_t *next) {
+    group_cpu_t *prev = cpu -> curr_group;
+    group_cpu_t *gc = NULL;
+
+    if (next != cpu -> k_thread) {
+        gc = minithread_group_cpu(next, cpu);
+        minithread_group_unqueue(cpu, gc);
     }
+    cpu -> curr_group = gc;
+    if (prev != NULL && prev != gc)
+        minithread_group_queue(cpu, prev);
+}
+
+/* 
+ * Cycles next may run before it has to give way: what is left of its
+ * real-time budget, or else of the quota of its group. UINT64_MAX if
+ * neither limits it.
+ */
+static uint64_t minithread_budget(minithread_t *next, uint64_t now) {
+    minithread_group_t *g = next -> group;
+
+    if (minithread_rt(next))
+        return next -> rt_runtime;
+    if (g == NULL || g -> quota == 0)
+        return UINT64_MAX;
+    if (now >= g -> period_end && !g -> throttled)
+        return g -> quota;
+    return g -> used < g -> quota ? g -> quota - g -> used : 0;
+}
 
-    if (quantum > 80) {           // level 0
-        multilevel_queue_dequeue(rd_list, 0, (void **) &next_thread);
-    } else if (quantum > 40) {    // level 1
-        multilevel_queue_dequeue(rd_list, 1, (void **) &next_thread);
-    } else if (quantum > 16) {    // level 2
-        multilevel_queue_dequeue(rd_list, 2, (void **) &next_thread);
-    } else if (quantum > 0) {     // level 3
-        multilevel_queue_dequeue(rd_list, 3, (void **) &next_thread);
-    } else if (quantum == 0) {    // switch back to level 0
-        quantum = 160;
-        multilevel_queue_dequeue(rd_list, 0, (void **) &next_thread);
+/* Have cpu rescheduled when next, which runs from time now, is out of budget */
+static void minithread_arm_budget(cpu_t *cpu, minithread_t *next,
+                                  uint64_t now) {
+    uint64_t budget = minithread_budget(next, now);
+
+    if (cpu -> budget_alarm != NULL) {
+        alarm_deregister(cpu -> budget_alarm);
+        cpu -> budget_alarm = NULL;
+    }
+    if (budget != UINT64_MAX) {
+        cpu -> budget_alarm = alarm_register_at(minithread_clock_now() + 
+            (uint64_t) (budget * ns_per_cycle),
+            minithread_budget_expire, cpu);
     }
+}
+
+/* 
+ * Switch cpu from curr to next at time now. next came off ready list level
+ * (-1 if it was not on one). curr goes back on the ready list if requeue is
+ * set. cpu must be locked; the lock is released once curr is off it, see
+ * minithread_switch_finish.
+ */
+static void minithread_switch_to(cpu_t *cpu, minithread_t *curr,
+                                 minithread_t *next, int level, int requeue,
+                                 int preempted, uint64_t now) {
     // Need to set current thread to next at here, since thread will switch out 
-    minithread_t *tmp_thread = curr_thread; 
-    curr_thread = next_thread;   
+    next -> cpu = cpu -> id;
+    next -> state = THREAD_ONCPU;
+    cpu -> curr_thread = next;
+    cpu -> prev = curr;
+    minithread_account(cpu, curr, next, level, preempted, now);
+    minithread_group_run(cpu, next);
+    minithread_arm_budget(cpu, next, now);
+    if (requeue) {
+        curr -> enqueued_at = now;
+        minithread_enqueue(cpu, curr);
+    }
+    TRACE(TRACE_SWITCH, curr -> tid, next -> tid);
+    if (curr -> exited)
+        cpu -> dead = curr;
+    // Only a preempted thread needs all of its registers saved
+    if (preempted)
+        minithread_switch(&(curr -> stack_ptr), &(next -> stack_ptr));
+    else
+        minithread_switch_fast(&(curr -> stack_ptr), &(next -> stack_ptr));
+}
 
-    // Not calling from minithread_stop, so add back to the ready list
-    if (x == 1 && tmp_thread != k_thread) {
-        multilevel_queue_enqueue(rd_list, next_level, tmp_thread);
+/* 
+ * Finish a context switch on this CPU. Called by the switch primitives on
+ * the stack of the thread switched to, before it goes on, with interrupts
+ * still disabled. The thread switched away from is off the CPU now: unlock
+ * the CPU, queue that thread if it was woken meanwhile, free it if it
+ * exited, and enable interrupts.
+ */
+void minithread_switch_finish() {
+    cpu_t *cpu = this_cpu;
+    minithread_t *prev = cpu -> prev;
+    int state = 0;
+
+    // Switches made outside the scheduler (see switch_bench) have no prev
+    if (prev != NULL) {
+        cpu -> prev = NULL;
+        state = swap(&(prev -> state), 0);
+        minithread_unlock(cpu);
     }
-    minithread_switch(&(tmp_thread -> stack_ptr), &(curr_thread -> stack_ptr));
-    
-    set_interrupt_level(old_level);
+    if (state & THREAD_WAKE)
+        minithread_start(prev);
+    minithread_reap(cpu);
+    set_interrupt_level(ENABLED);
 }
 
-/* Final bookkeeping function */
-int finalProc(int *argv) {
-    interrupt_level_t old_level = set_interrupt_level(DISABLED);
-    if (queue_append(f_list, curr_thread) == -1) {
-        fprintf(stderr, "Failed to append to the finished queue.");
-        exit(0);
+/* 
+ * Restore the interrupt level of a caller of the scheduler once it goes on:
+ * take the kernel lock again if it held it, since the thread it switched to
+ * released it.
+ */
+static void minithread_restore_level(interrupt_level_t old_level, int locked) {
+    if (locked)
+        set_interrupt_level(DISABLED);
+    else
+        set_interrupt_level_local(old_level);
+}
+
+/* 
+ * x == 1, added back to the queue, x == 0 otherwise
+ */
+void minithread_schedule(int x) {
+    interrupt_level_t old_level = set_interrupt_level_local(DISABLED);
+    int locked = kernel_locked();
+    cpu_t *cpu = this_cpu;
+    minithread_t *curr_thread = cpu -> curr_thread;
+    minithread_t *next_thread;
+    int preempted = cpu -> preempting;
+    uint64_t now, ran;
+
+    // Woken before it got off the CPU, so it need not get off at all
+    if (x == 0 && compare_and_swap(&(curr_thread -> state),
+                                   THREAD_ONCPU | THREAD_WAKE,
+                                   THREAD_ONCPU) == (THREAD_ONCPU | THREAD_WAKE)) {
+        minithread_restore_level(old_level, locked);
+        return;
     }
-    semaphore_V(cleanup_sem);
-    // Don't add the thread back to the ready queue
-    minithread_schedule(0);
-    set_interrupt_level(old_level);
-    exit(0);
+    minithread_reap(cpu);
+    // Its quantum is over, so send what it queued
+    network_flush();
+
+    minithread_lock_sched(cpu);
+    now = minithread_cycles();
+    ran = now - curr_thread -> ran_at;
+    cpu -> preempting = 0;
+    cpu -> need_resched = 0;
+    TRACE(TRACE_SCHEDULE, curr_thread -> tid, preempted);
+    minithread_group_tick(cpu, curr_thread, ran, x == 0, now);
+    minithread_rt_charge(curr_thread, ran, now);
+
+    // A thread that yields competes for its group, see minithread_dequeue
+    cpu -> yielding = x != 0 && curr_thread != cpu -> k_thread;
+    next_thread = NULL;
+    // A real-time thread beats all but other real-time ones, so it keeps the
+    // CPU when it yields unless one of those is ready
+    if ((x == 0 || cpu -> nrt > 0 || !minithread_rt(curr_thread)) &&
+        (cpu -> nready > 0 || minithread_steal(cpu) == 0))
+        next_thread = minithread_dequeue(cpu, 1);
+    cpu -> yielding = 0;
+
+    if (next_thread == NULL) {
+        if (curr_thread == cpu -> k_thread) {
+            minithread_unlock(cpu);
+            minithread_restore_level(old_level, locked);
+            return;
+        }
+        // Nothing else to run, so a thread that may go on keeps the CPU
+        if (x != 0 && minithread_runnable(curr_thread)) {
+            curr_thread -> cpu_time += ran;
+            curr_thread -> ran_at = now;
+            minithread_arm_budget(cpu, curr_thread, now);
+            minithread_unlock(cpu);
+            minithread_restore_level(old_level, locked);
+            return;
+        }
+
+        // Switch to kernel thread
+        minithread_switch_to(cpu, curr_thread, cpu -> k_thread, -1, x != 0,
+                             preempted, now);
+        minithread_restore_level(old_level, locked);
+        return;
+    }
+
+    // Not calling from minithread_stop, so add back to the ready list
+    minithread_switch_to(cpu, curr_thread, next_thread,
+                         next_thread -> se.run_level,
+                         x != 0 && curr_thread != cpu -> k_thread, preempted,
+                         now);
+    minithread_restore_level(old_level, locked);
 }
 
-/* Helper function to clean up thread */
-void clean_up_helper(void *t, void *x) {
-    minithread_t *f_thread;
+/* 
+ * Final bookkeeping function, gets what proc returned. The next context
+ * switch on this CPU frees the stack (see minithread_reap), so exiting
+ * costs no extra switch.
+ */
+int finalProc(int *argv, int retval) {
     interrupt_level_t old_level = set_interrupt_level(DISABLED);
-    if (queue_dequeue(f_list, ( void ** )&f_thread ) == -1) {       // no thread to switch to
-        fprintf(stderr, "Failed to fetch next job from the final list\n");
-        return; 
+    minithread_t *self = this_cpu -> curr_thread;
+    self -> retval = retval;
+    self -> exited = 1;
+    self -> group -> threads--;
+    if (self -> rt_period != 0) {
+        cpus[self -> rt_cpu] -> rt_utilization -= self -> rt_share;
+        budgeted--;
     }
+    if (self -> rt_replenish != NULL)
+        alarm_deregister(self -> rt_replenish);
+    if (self -> joiner != NULL)
+        minithread_start(self -> joiner);
+    // Don't add the thread back to the ready queue
+    minithread_schedule(0);
     set_interrupt_level(old_level);
-    minithread_free_stack(f_thread -> stack_base);
-    free(f_thread);
-    return;
-} 
-
-/* Cleap up thread routine */
-int clean_up(int *x) {
-    while (1) {
-        semaphore_P(cleanup_sem);
-        interrupt_level_t old_level = set_interrupt_level(DISABLED);
-        if (queue_length(f_list) > 0)
-            queue_iterate(f_list, &clean_up_helper, NULL);
-        set_interrupt_level(old_level);
-        minithread_yield();
-    }
+    exit(0);
 }
 
 /* minithread functions */
@@ -138,7 +962,38 @@ minithread_t* minithread_fork(proc_t proc, arg_t arg) {
     return new_thread;
 }
 
+minithread_t* minithread_fork_in_group(minithread_group_t *g, proc_t proc,
+                                      arg_t arg) {
+    minithread_t *new_thread;
+    if ((new_thread = minithread_create(proc, arg)) == NULL)
+        return NULL;
+    minithread_set_group(new_thread, g);
+    minithread_start(new_thread);
+    return new_thread;
+}
+
+minithread_t* minithread_fork_joinable(proc_t proc, arg_t arg) {
+    minithread_t *new_thread;
+    if ((new_thread = minithread_create_joinable(proc, arg)) == NULL)
+        return NULL;
+    minithread_start(new_thread);
+    return new_thread;
+}
+
 minithread_t* minithread_create(proc_t proc, arg_t arg) {
+    return minithread_create_with_stack(proc, arg, 0);
+}
+
+minithread_t* minithread_create_joinable(proc_t proc, arg_t arg) {
+    minithread_t *new_thread = minithread_create(proc, arg);
+    // Not started yet, so nothing else can look at it
+    if (new_thread != NULL)
+        new_thread -> detached = 0;
+    return new_thread;
+}
+
+minithread_t* minithread_create_with_stack(proc_t proc, arg_t arg,
+                                           int stack_size) {
     // Create a new thread
     minithread_t *thread_ptr = (minithread_t *) malloc(sizeof(minithread_t));
     if (thread_ptr == NULL) {
@@ -146,59 +1001,199 @@ minithread_t* minithread_create(proc_t proc, arg_t arg) {
         return NULL;
     }
     
-    minithread_allocate_stack(&(thread_ptr -> stack_base), 
-        &(thread_ptr -> stack_ptr));
-    minithread_initialize_stack(&(thread_ptr -> stack_ptr), 
-        proc, arg, finalProc, NULL);
+    minithread_allocate_stack_size(&(thread_ptr -> stack_base), 
+        &(thread_ptr -> stack_ptr), stack_size);
     // allocate stack failed
     if (thread_ptr -> stack_ptr == NULL) {
         free(thread_ptr);
         fprintf(stderr, "Allocate stack failed\n");
         return NULL;
     }
-    thread_ptr -> level = 0;
-    thread_ptr -> quantum_remain = 1;
+    minithread_initialize_stack(&(thread_ptr -> stack_ptr), 
+        proc, arg, (proc_t) finalProc, NULL);
+    sched -> init(&(thread_ptr -> se));
+    thread_ptr -> cpu = -1;
+    thread_ptr -> state = 0;
+    thread_ptr -> retval = 0;
+    thread_ptr -> exited = 0;
+    thread_ptr -> detached = 1;
+    thread_ptr -> joiner = NULL;
+    thread_ptr -> ready_cpu = NULL;
+    thread_ptr -> rt_ready = 0;
+    thread_ptr -> rt_period = thread_ptr -> rt_budget = 0;
+    thread_ptr -> rt_runtime = 0;
+    thread_ptr -> rt_done = 1;
+    thread_ptr -> rt_cpu = 0;
+    thread_ptr -> rt_share = 0;
+    thread_ptr -> rt_replenish = NULL;
+    thread_ptr -> jobs = thread_ptr -> deadline_misses = 0;
+    thread_ptr -> mutex_waiting = NULL;
+    thread_ptr -> mutexes_held = NULL;
+    thread_ptr -> link.previous = NULL;
+    thread_ptr -> link.next = NULL;
+    thread_ptr -> link.queue = NULL;
+    minithread_account_init(thread_ptr);
     // Disable interrupt to prevent two thread have the same tid.
     interrupt_level_t old_level = set_interrupt_level(DISABLED);
     thread_ptr -> tid = next_tid;
     next_tid++;
+    // A new thread joins the group of its creator
+    thread_ptr -> group = this_cpu -> curr_thread -> group;
+    if (thread_ptr -> group == NULL)
+        thread_ptr -> group = default_group;
+    thread_ptr -> group -> threads++;
     set_interrupt_level(old_level);
     return thread_ptr;
 }
 
+queue_t* minithread_queue_new() {
+    return queue_new_intrusive(offsetof(minithread_t, link));
+}
+
 minithread_t* minithread_self() {
-    return curr_thread;
+    return this_cpu -> curr_thread;
 }
 
 int minithread_id() {
-    return curr_thread -> tid;
+    return minithread_self() -> tid;
 }
 
-void minithread_stop() {
+int minithread_join(minithread_t *t, int *retval) {
     interrupt_level_t old_level = set_interrupt_level(DISABLED);
-    minithread_schedule(0);
+    minithread_t *self = this_cpu -> curr_thread;
+
+    if (t == NULL || t == self || t -> detached || t -> joiner != NULL) {
+        set_interrupt_level(old_level);
+        return -1;
+    }
+    if (!t -> exited) {
+        t -> joiner = self;
+        minithread_stop();
+    }
+    if (retval != NULL)
+        *retval = t -> retval;
+    // A stack still in use is freed along with the thread when reaped
+    if (t -> stack_base == NULL)
+        free(t);
+    else
+        t -> detached = 1;
     set_interrupt_level(old_level);
+    return 0;
 }
 
-void minithread_start(minithread_t *t) {
+void minithread_detach(minithread_t *t) {
+    interrupt_level_t old_level = set_interrupt_level(DISABLED);
+    if (t != NULL && t -> joiner == NULL) {
+        if (t -> exited && t -> stack_base == NULL)
+            free(t);
+        else
+            t -> detached = 1;
+    }
+    set_interrupt_level(old_level);
+}
+
+int minithread_level(minithread_t *t) {
+    return minithread_effective_level(t, t -> se.run_level);
+}
+
+void minithread_inherit_level(minithread_t *t, int level) {
     interrupt_level_t old_level = set_interrupt_level(DISABLED);
+    uint64_t locked;
+    cpu_t *cpu;
+
+    if (level < 0)
+        level = 0;
+    if (level > MINITHREAD_LEVELS)
+        level = MINITHREAD_LEVELS;
+    if (t -> se.inherited == level) {
+        set_interrupt_level(old_level);
+        return;
+    }
+    locked = minithread_lock_all();
+    t -> se.inherited = level;
+    // Queue a ready thread again, so the policy places it by its new level
+    cpu = t -> ready_cpu;
+    if (cpu != NULL && minithread_unqueue(cpu, t) == 0)
+        minithread_enqueue(cpu, t);
+    minithread_unlock_all(locked);
+    set_interrupt_level(old_level);
+}
+
+struct mutex** minithread_mutex_waiting(minithread_t *t) {
+    return &(t -> mutex_waiting);
+}
+
+struct mutex** minithread_mutexes_held(minithread_t *t) {
+    return &(t -> mutexes_held);
+}
+
+void minithread_stop() {
+    minithread_schedule(0);
+}
+
+void minithread_start(minithread_t *t) {
+    interrupt_level_t old_level;
+    cpu_t *cpu;
+    int state, locked;
     if (t == NULL) 
         return;
-    // Thread that is made runnable is enqueued to level 0
-    if (multilevel_queue_enqueue(rd_list, 0, (void*) t) == -1) {
-        fprintf(stderr, "Failed to start the thread\n");
+    old_level = set_interrupt_level_local(DISABLED);
+    // Still getting off its CPU, which goes on with it or queues it after
+    while ((state = t -> state) & THREAD_ONCPU) {
+        if (compare_and_swap(&(t -> state), state, state | THREAD_WAKE) ==
+            state) {
+            set_interrupt_level_local(old_level);
+            return;
+        }
+    }
+    t -> enqueued_at = minithread_cycles();
+    cpu = minithread_ready_cpu(minithread_pick_cpu(t), t);
+    locked = minithread_lock(cpu);
+    sched -> wake(minithread_group_cpu(t, cpu) -> rq, &(t -> se));
+    minithread_enqueue(cpu, t);
+    if (locked)
+        minithread_unlock(cpu);
+    set_interrupt_level_local(old_level);
+}
+
+void minithread_handoff(minithread_t *t) {
+    interrupt_level_t old_level = set_interrupt_level_local(DISABLED);
+    int locked = kernel_locked();
+    cpu_t *cpu = this_cpu;
+    minithread_t *curr_thread = cpu -> curr_thread;
+    uint64_t now;
+
+    // The idle thread never goes on a ready list, so it can't step aside,
+    // and a real-time thread runs on the CPU that admitted it only. Nor can
+    // t run here while it is still getting off another CPU
+    if (curr_thread == cpu -> k_thread ||
+        (minithread_rt(t) && t -> rt_cpu != cpu -> id) ||
+        compare_and_swap(&(t -> state), 0, THREAD_ONCPU) != 0) {
+        minithread_start(t);
+        minithread_restore_level(old_level, locked);
         return;
     }
-    set_interrupt_level(old_level);
+    minithread_reap(cpu);
+    minithread_lock_sched(cpu);
+    TRACE(TRACE_SCHEDULE, curr_thread -> tid, 0);
+    // t is woken like by minithread_start, but runs at once
+    sched -> wake(minithread_group_cpu(t, cpu) -> rq, &(t -> se));
+    // t runs in what is left of our quantum, which is not charged to us,
+    // though our group is charged for the CPU time
+    now = minithread_cycles();
+    minithread_group_charge(curr_thread -> group, now - curr_thread -> ran_at,
+                            now);
+    minithread_switch_to(cpu, curr_thread, t, -1, 1, 0, now);
+    minithread_restore_level(old_level, locked);
 }
 
 void minithread_yield() {
-    interrupt_level_t old_level = set_interrupt_level(DISABLED);
-    if (multilevel_queue_length(rd_list) > 0) {
+    interrupt_level_t old_level = set_interrupt_level_local(DISABLED);
+    if (this_cpu -> nready > 0) {
         // If queue length is 1, it will yield to itself
         minithread_schedule(1);   
     }
-    set_interrupt_level(old_level);
+    set_interrupt_level_local(old_level);
 }
 
 /*
@@ -208,92 +1203,455 @@ void minithread_yield() {
  */
 void clock_handler(void* arg) {
     interrupt_level_t old_level = set_interrupt_level(DISABLED);
-    ticks++;
+    cpu_t *cpu = this_cpu;
+    // Ticks follow host time, so any CPU can advance them and fire alarms
+    ticks = minithread_clock_ticks();
     do_alarms();
-    if (curr_thread != k_thread) {
-        minithread_yield(); 
-    } else if (curr_thread == k_thread && 
-        multilevel_queue_length(rd_list) > 1) {
-        // Have thread other than cleanup thread in the ready list
+    if (cpu -> curr_thread != cpu -> k_thread) {
+        cpu -> preempting = 1;
+        // One that must give way does even if nothing else is ready
+        if (cpu -> need_resched)
+            minithread_schedule(1);
+        else
+            minithread_yield(); 
+        this_cpu -> preempting = 0;
+    } else if (cpu -> nready > 0) {
+        // Have threads in the ready list, 
         // kernel thread should not be in the ready list.
         minithread_schedule(0);   
     }
     set_interrupt_level(old_level); 
 }
 
+/* High-resolution alarm (one-shot timer) interrupt handler */
+void timer_handler(void* arg) {
+    interrupt_level_t old_level = set_interrupt_level(DISABLED);
+    cpu_t *cpu = this_cpu;
+    do_alarms();
+    // A real-time thread woke up with an earlier deadline, so it runs now,
+    // or the running thread ran out of budget and gives way if it must
+    if (cpu -> need_resched && cpu -> curr_thread != cpu -> k_thread) {
+        cpu -> preempting = 1;
+        minithread_schedule(1);
+        this_cpu -> preempting = 0;
+    }
+    set_interrupt_level(old_level);
+}
+
+/* Network interrupt handler: take every packet that arrived, arg first */
 void network_handler(network_interrupt_arg_t* arg) {
     interrupt_level_t old_level = set_interrupt_level(DISABLED);
-    mini_header_t *header = (mini_header_t *) arg -> buffer;
-    if (header -> protocol == PROTOCOL_MINIDATAGRAM) {
-        minimsg_append(arg);
-    } else if (header -> protocol == PROTOCOL_MINISTREAM) {
-        minisocket_append(arg);
+    mini_header_t *header;
+    // One slice for the batch, tagged with the packet that raised it
+    TRACE(TRACE_NETWORK_BEGIN, arg, 0);
+    while ((arg = network_next_pkt()) != NULL) {
+        header = (mini_header_t *) arg -> buffer;
+        if (header -> protocol == PROTOCOL_MINIDATAGRAM) {
+            minimsg_append(arg);
+        } else if (header -> protocol == PROTOCOL_MINISTREAM) {
+            minisocket_append(arg);
+        }
     }
+    TRACE(TRACE_NETWORK_END, 0, 0);
     set_interrupt_level(old_level);
 }
 
 void minithread_sleep_with_timeout(int delay) {
+    minithread_sleep_for((uint64_t) delay * MICROSECOND);
+}
+
+void minithread_sleep_until(uint64_t deadline) {
     interrupt_level_t old_level = set_interrupt_level(DISABLED);
-    minithread_t *tmp_thread = curr_thread;
-    alarm_id ret = alarm_register(delay / 1000, 
-        (alarm_handler_t) minithread_start, tmp_thread);
+    minithread_t *self = minithread_self();
+    alarm_id ret = alarm_register_at(deadline, 
+        (alarm_handler_t) minithread_start, self);
     assert(ret != NULL);
-    set_interrupt_level(old_level);
+    // Sleeping ends the job of a real-time thread in this period
+    if (self -> rt_period != 0) {
+        self -> jobs++;
+        if (minithread_cycles() > self -> se.deadline)
+            self -> deadline_misses++;
+        self -> rt_done = 1;
+    }
+    // Stop before enabling, so the alarm cannot start us while running
     minithread_stop();
+    alarm_deregister(ret);
+    set_interrupt_level(old_level);
 }
 
-void minithread_system_initialize(proc_t mainproc, arg_t mainarg) { 
-    int ret; 
-
-    // Initialize ready list and finish list 
-    rd_list = multilevel_queue_new(4);
-    f_list = queue_new();
-    alarm_list = queue_new();
+void minithread_sleep_for(uint64_t delay) {
+    minithread_sleep_until(minithread_clock_now() + delay);
+}
 
-    // Initialize kernel thread
-    k_thread = (minithread_t *) malloc(sizeof(minithread_t));   
-    if (k_thread == NULL) {
-        fprintf(stderr, "Failed to initialize kernel thread.");
+/*
+ * Put an idle CPU to sleep in the host until a thread becomes runnable, an
+ * interrupt arrives or the next alarm is due. Time may have passed without
+ * ticks, so catch up on it and fire due alarms first.
+ */
+static void minithread_idle_sleep(cpu_t *cpu) {
+    long wake_tick;
+    interrupt_level_t old_level = set_interrupt_level(DISABLED);
+    ticks = minithread_clock_ticks();
+    do_alarms();
+    wake_tick = alarm_next_tick();
+    if (ready_threads > 0) {
+        set_interrupt_level(old_level);
         return;
     }
-    // Since k_thread will not be in the ready list
-    // don't need to initialize level and quantum_remain
+    // A CPU queueing a thread counts it in ready_threads before it looks
+    // for sleeping CPUs, and we count ourselves before we look at it
+    cpu -> sleeping = 1;
+    __sync_fetch_and_add(&sleeping_cpus, 1);
+    set_interrupt_level(old_level);
+
+    minithread_clock_sleep(wake_tick, &ready_threads);
+
+    // Unless minithread_wake got here first
+    if (compare_and_swap(&(cpu -> sleeping), 1, 0) == 1)
+        __sync_fetch_and_sub(&sleeping_cpus, 1);
+}
+
+/* 
+ * Idle loop of a CPU, run by its kernel thread. Sleep in the host until
+ * some CPU has a thread ready, then run or steal it.
+ */
+void minithread_idle() {
+    cpu_t *cpu = this_cpu;
+    while (1) {
+        if (ready_threads == 0) {
+            minithread_idle_sleep(cpu);
+            continue;
+        }
+        // minithread_schedule steals if need be
+        if (cpu -> nready > 0 || minithread_victim(cpu) != NULL)
+            minithread_schedule(0);
+    }
+}
+
+/* Allocate a CPU with an empty ready list and its kernel thread */
+cpu_t* minithread_cpu_new(int id) {
+    cpu_t *cpu = (cpu_t *) malloc(sizeof(cpu_t));
+    minithread_t *k_thread = (minithread_t *) malloc(sizeof(minithread_t));
+    if (cpu == NULL || k_thread == NULL) {
+        free(cpu);
+        free(k_thread);
+        return NULL;
+    }
+    cpu -> groups = sched_cfs.new();
+    cpu -> rt = sched_edf.new();
+    if (cpu -> groups == NULL || cpu -> rt == NULL) {
+        free(cpu);
+        free(k_thread);
+        return NULL;
+    }
+    // k_thread is never on the ready list, and is in no group
+    sched -> init(&(k_thread -> se));
+    k_thread -> group = NULL;
     k_thread -> stack_ptr = NULL;
     k_thread -> stack_base = NULL;
+    k_thread -> cpu = id;
+    k_thread -> ready_cpu = NULL;
+    k_thread -> rt_ready = 0;
+    k_thread -> rt_period = 0;
+    k_thread -> mutex_waiting = NULL;
+    k_thread -> mutexes_held = NULL;
+    minithread_account_init(k_thread);
     k_thread -> tid = next_tid;
     next_tid++;
-    curr_thread = k_thread;
+    k_thread -> state = THREAD_ONCPU;
+    cpu -> id = id;
+    cpu -> lock = 0;
+    cpu -> owner = NULL;
+    cpu -> nready = 0;
+    cpu -> nrt = 0;
+    cpu -> rt_utilization = 0;
+    cpu -> curr_group = NULL;
+    cpu -> ngroups = 0;
+    cpu -> yielding = 0;
+    cpu -> group_min = 0;
+    cpu -> need_resched = 0;
+    cpu -> budget_alarm = NULL;
+    cpu -> k_thread = k_thread;
+    cpu -> curr_thread = k_thread;
+    cpu -> sleeping = 0;
+    cpu -> preempting = 0;
+    cpu -> dead = NULL;
+    cpu -> prev = NULL;
+    memset(cpu -> latency, 0, sizeof(cpu -> latency));
+    return cpu;
+}
 
-    minithread_t *c_thread; 
-    cleanup_sem = semaphore_create();
-    semaphore_initialize(cleanup_sem, 0);
-    
-    // Kernel create the first thread or Kernel create the reaper thread    
-    if (minithread_fork(mainproc, mainarg) == NULL ||      
-        (c_thread = minithread_fork(&clean_up, NULL)) == NULL) {
+/* Host thread body of every CPU but CPU 0 */
+void* minithread_cpu_start(void *arg) {
+    char name[16];
+
+    this_cpu = (cpu_t *) arg;
+    snprintf(name, sizeof(name), "cpu %d", this_cpu -> id);
+    trace_attach(name);
+    minithread_clock_init_cpu();
+    set_interrupt_level(ENABLED);
+    minithread_idle();
+    return NULL;
+}
+
+void minithread_stats(minithread_t *t, minithread_stats_t *stats) {
+    interrupt_level_t old_level = set_interrupt_level(DISABLED);
+    int i, level, bucket;
+
+    memset(stats, 0, sizeof(*stats));
+    if (t != NULL) {
+        stats -> cpu_time = t -> cpu_time;
+        // Include the time slice in progress
+        if (t -> cpu >= 0 && cpus[t -> cpu] -> curr_thread == t)
+            stats -> cpu_time += minithread_cycles() - t -> ran_at;
+        stats -> cpu_time *= ns_per_cycle;
+        stats -> voluntary_switches = t -> voluntary_switches;
+        stats -> involuntary_switches = t -> involuntary_switches;
+        stats -> jobs = t -> jobs;
+        stats -> deadline_misses = t -> deadline_misses;
+        for (level = 0; level < MINITHREAD_LEVELS; level++)
+            stats -> wait_time[level] = t -> wait_time[level] * ns_per_cycle;
+    }
+    for (i = 0; i < ncpus; i++) {
+        for (level = 0; level < MINITHREAD_LEVELS; level++) {
+            for (bucket = 0; bucket < MINITHREAD_LATENCY_BUCKETS; bucket++)
+                stats -> latency[level][bucket] += 
+                    cpus[i] -> latency[level][bucket];
+        }
+    }
+    set_interrupt_level(old_level);
+}
+
+void minithread_set_scheduler(struct sched_ops *ops) {
+    if (ops != NULL)
+        sched = ops;
+}
+
+int minithread_set_deadline(minithread_t *t, uint64_t period, 
+                            uint64_t budget) {
+    interrupt_level_t old_level = set_interrupt_level(DISABLED);
+    double share = period != 0 ? (double) budget / period : 0;
+    cpu_t *cpu = NULL;
+    uint64_t locked;
+    int i;
+
+    if (t == NULL || budget > period) {
+        set_interrupt_level(old_level);
+        return -1;
+    }
+    if (t -> rt_period != 0)
+        cpus[t -> rt_cpu] -> rt_utilization -= t -> rt_share;
+    // Each real-time thread only runs on the CPU that admits it, and EDF
+    // meets every deadline on one CPU as long as the shares there add up to
+    // at most 1. Keep t where it is if it still fits, else take the first
+    // CPU it fits on.
+    if (period != 0) {
+        if (cpus[t -> rt_cpu] -> rt_utilization + share <= 1 + 1e-9)
+            cpu = cpus[t -> rt_cpu];
+        for (i = 0; cpu == NULL && i < ncpus; i++) {
+            if (cpus[i] -> rt_utilization + share <= 1 + 1e-9)
+                cpu = cpus[i];
+        }
+        if (cpu == NULL) {
+            if (t -> rt_period != 0)
+                cpus[t -> rt_cpu] -> rt_utilization += t -> rt_share;
+            set_interrupt_level(old_level);
+            return -1;
+        }
+        cpu -> rt_utilization += share;
+        t -> rt_cpu = cpu -> id;
+        t -> rt_share = share;
+    }
+    if (t -> rt_replenish != NULL) {
+        alarm_deregister(t -> rt_replenish);
+        t -> rt_replenish = NULL;
+    }
+    locked = minithread_lock_all();
+    budgeted -= t -> rt_period != 0;
+    t -> rt_period = period / ns_per_cycle;
+    t -> rt_budget = budget / ns_per_cycle;
+    t -> rt_runtime = t -> rt_budget;
+    t -> rt_done = 1;
+    t -> se.deadline = minithread_cycles() + t -> rt_period;
+    budgeted += t -> rt_period != 0;
+    minithread_unlock_all(locked);
+    set_interrupt_level(old_level);
+    return 0;
+}
+
+void minithread_set_weight(minithread_t *t, int weight) {
+    interrupt_level_t old_level = set_interrupt_level(DISABLED);
+    uint64_t locked = minithread_lock_all();
+    t -> se.weight = weight > 0 ? weight : 1;
+    minithread_unlock_all(locked);
+    set_interrupt_level(old_level);
+}
+
+minithread_group_t* minithread_group_create(int weight) {
+    minithread_group_t *g = (minithread_group_t *) malloc(
+        sizeof(minithread_group_t) + ncpus * sizeof(group_cpu_t));
+    group_cpu_t *gc;
+    int i;
+
+    if (g == NULL)
+        return NULL;
+    for (i = 0; i < ncpus; i++) {
+        gc = &(g -> percpu[i]);
+        if ((gc -> rq = sched -> new()) == NULL) {
+            free(g);
+            return NULL;
+        }
+        sched_cfs.init(&(gc -> se));
+        gc -> se.weight = weight > 0 ? weight : 1;
+        gc -> nready = 0;
+        gc -> on_tree = 0;
+        gc -> group = g;
+    }
+    g -> threads = 0;
+    g -> cpu_time = 0;
+    g -> quota = g -> period = 0;
+    g -> used = g -> period_end = 0;
+    g -> throttled = 0;
+    g -> throttles = 0;
+    g -> unthrottle = NULL;
+    return g;
+}
+
+void minithread_group_set_weight(minithread_group_t *g, int weight) {
+    interrupt_level_t old_level = set_interrupt_level(DISABLED);
+    uint64_t locked = minithread_lock_all();
+    int i;
+
+    for (i = 0; i < ncpus; i++)
+        g -> percpu[i].se.weight = weight > 0 ? weight : 1;
+    minithread_unlock_all(locked);
+    set_interrupt_level(old_level);
+}
+
+int minithread_group_set_quota(minithread_group_t *g, uint64_t quota,
+                               uint64_t period) {
+    interrupt_level_t old_level = set_interrupt_level(DISABLED);
+    uint64_t locked;
+
+    if (quota != 0 && period == 0) {
+        set_interrupt_level(old_level);
+        return -1;
+    }
+    locked = minithread_lock_all();
+    budgeted -= g -> quota != 0;
+    g -> quota = quota / ns_per_cycle;
+    budgeted += g -> quota != 0;
+    g -> period = period / ns_per_cycle;
+    g -> used = 0;
+    g -> period_end = 0;
+    if (g -> unthrottle != NULL) {
+        alarm_deregister(g -> unthrottle);
+        g -> unthrottle = NULL;
+    }
+    // The new quota applies from the next period, which begins now
+    minithread_group_unthrottle(g);
+    minithread_unlock_all(locked);
+    set_interrupt_level(old_level);
+    return 0;
+}
+
+minithread_group_t* minithread_group(minithread_t *t) {
+    return t -> group;
+}
+
+int minithread_set_group(minithread_t *t, minithread_group_t *g) {
+    interrupt_level_t old_level = set_interrupt_level(DISABLED);
+    uint64_t locked;
+    cpu_t *cpu;
+    int ready;
+
+    if (g == NULL || t -> exited) {
+        set_interrupt_level(old_level);
+        return -1;
+    }
+    locked = minithread_lock_all();
+    // A ready thread moves to the ready list of its new group
+    cpu = t -> ready_cpu;
+    ready = cpu != NULL && minithread_unqueue(cpu, t) == 0;
+    t -> group -> threads--;
+    t -> group = g;
+    g -> threads++;
+    if (ready)
+        minithread_enqueue(cpu, t);
+    minithread_unlock_all(locked);
+    set_interrupt_level(old_level);
+    return 0;
+}
+
+void minithread_group_stats(minithread_group_t *g,
+                            minithread_group_stats_t *stats) {
+    interrupt_level_t old_level = set_interrupt_level(DISABLED);
+    uint64_t now = minithread_cycles();
+    int i;
+
+    stats -> cpu_time = g -> cpu_time;
+    // Include the time slices in progress
+    for (i = 0; i < ncpus; i++) {
+        if (cpus[i] -> curr_group != NULL && 
+            cpus[i] -> curr_group -> group == g)
+            stats -> cpu_time += now - cpus[i] -> curr_thread -> ran_at;
+    }
+    stats -> cpu_time *= ns_per_cycle;
+    stats -> throttles = g -> throttles;
+    stats -> threads = g -> threads;
+    set_interrupt_level(old_level);
+}
+
+void minithread_set_cpus(int n) {
+    if (n < 1)
+        n = 1;
+    if (n > MAX_CPUS)
+        n = MAX_CPUS;
+    ncpus = n;
+}
+
+void minithread_system_initialize(proc_t mainproc, arg_t mainarg) { 
+    minithread_t *main_thread;
+    int ret, i; 
+
+    minithread_calibrate_cycles();
+
+    // Initialize CPUs, finish list and alarms
+    for (i = 0; i < ncpus; i++) {
+        if ((cpus[i] = minithread_cpu_new(i)) == NULL) {
+            fprintf(stderr, "Failed to initialize CPU %d.", i);
+            return;
+        }
+    }
+    this_cpu = cpus[0];
+    if ((default_group = minithread_group_create(SCHED_WEIGHT_DEFAULT)) == NULL) {
+        fprintf(stderr, "Failed to create the default group\n");
+        return;
+    }
+    trace_attach("cpu 0");
+    alarm_initialize();
+
+    // Kernel create the first thread, nobody joins it
+    if ((main_thread = minithread_fork(mainproc, mainarg)) == NULL) {
         fprintf(stderr, "Failed to create new thread\n");   
         return;
     }
-    cleanup_thread = c_thread;
 
     // Initialize interrupt
     minithread_clock_init(&clock_handler);
+    minithread_timer_init(&timer_handler);
     ret = network_initialize(&network_handler);
     assert(ret == 0);
     minimsg_initialize();
     minisocket_initialize();
-    set_interrupt_level(ENABLED);
 
-    // Idle loop
-    while (1) {
-        interrupt_level_t old_level = set_interrupt_level(DISABLED);
-        // Not just the clean-up thread in the queue
-        if (multilevel_queue_length(rd_list) > 0) {   
-            minithread_yield();
-            curr_thread = k_thread;
-        }
-        set_interrupt_level(old_level);
+    // Bring up the other CPUs, which may wake us as soon as they run
+    cpus[0] -> host = pthread_self();
+    for (i = 1; i < ncpus; i++) {
+        ret = pthread_create(&(cpus[i] -> host), NULL, minithread_cpu_start, cpus[i]);
+        assert(ret == 0);
     }
+    set_interrupt_level(ENABLED);
 
-    free(k_thread);
-}
\ No newline at end of file
+    minithread_idle();
+}
@@ -14,24 +14,112 @@
  *  You must define the thread control block as a struct minithread.
  */
 typedef struct minithread minithread_t;
+typedef struct minithread_group minithread_group_t;
+struct mutex;
+struct sched_ops;
+
+/* Maximum number of virtual CPUs */
+#define MAX_CPUS 64
+
+/* Number of levels of the multilevel feedback ready list, at most */
+#define MINITHREAD_LEVELS 4
+
+/* Number of buckets of a run-queue latency histogram */
+#define MINITHREAD_LATENCY_BUCKETS 32
+
+/*
+ * Scheduler statistics, see minithread_stats. Times are in nanoseconds.
+ * Bucket i of a latency histogram counts waits in the ready list of at
+ * least 2^i ns and less than 2^(i+1) ns; bucket 0 also counts shorter waits
+ * and the last bucket all longer ones.
+ */
+typedef struct minithread_stats {
+    uint64_t cpu_time;              // time the thread ran
+    uint64_t voluntary_switches;    // times it gave up the CPU itself
+    uint64_t involuntary_switches;  // times it was preempted
+    uint64_t jobs;                  // periods it slept in, if real-time
+    uint64_t deadline_misses;       // periods it did not sleep in time
+    uint64_t wait_time[MINITHREAD_LEVELS];  // time ready, by level
+    // run-queue latency of all threads, by level
+    uint64_t latency[MINITHREAD_LEVELS][MINITHREAD_LATENCY_BUCKETS];
+} minithread_stats_t;
+
+/* Thread group statistics, see minithread_group_stats */
+typedef struct minithread_group_stats {
+    uint64_t cpu_time;              // time its threads ran, in nanoseconds
+    uint64_t throttles;             // periods it ran out of quota in
+    int threads;                    // threads in it that did not exit
+} minithread_group_stats_t;
 
 /* Global variables needed in other files*/
-extern queue_t *alarm_list;		// list of waiting alarms
 extern int current_time;		// time in milliseconds
 
 /*
  * Create and schedule a new thread of control so
  * that it starts executing inside proc_t with
- * initial argument arg.
+ * initial argument arg. The thread is freed when it
+ * finishes, so the caller may use the result only
+ * while it is known to be running.
  */
 minithread_t* minithread_fork(proc_t proc, arg_t arg);
 
+/*
+ * Like minithread_fork, but the thread can be joined, and lives until it
+ * is (see minithread_join).
+ */
+minithread_t* minithread_fork_joinable(proc_t proc, arg_t arg);
+
+/*
+ * Like minithread_fork, but the thread is in group g rather than that of
+ * its creator (see minithread_group_create).
+ */
+minithread_t* minithread_fork_in_group(minithread_group_t *g, proc_t proc,
+                                      arg_t arg);
+
 /*
  * Like minithread_fork, only returned thread is not scheduled
  * for execution.
  */
 minithread_t* minithread_create(proc_t proc, arg_t arg);
 
+/*
+ * Like minithread_create, but the thread can be joined, as with
+ * minithread_fork_joinable.
+ */
+minithread_t* minithread_create_joinable(proc_t proc, arg_t arg);
+
+/*
+ * Like minithread_create, but the thread gets a stack of stack_size bytes
+ * (rounded up to whole pages) instead of the default 256 KB. Stack pages
+ * are committed lazily, so small stacks mainly save address space and
+ * mappings when running very many threads.
+ */
+minithread_t* minithread_create_with_stack(proc_t proc, arg_t arg,
+                                           int stack_size);
+
+/*
+ * Wait for thread t to finish and store what its proc returned in *retval
+ * (unless retval is NULL). Only threads made by minithread_fork_joinable or
+ * minithread_create_joinable can be joined. Their control block lives until
+ * they are joined or detached, so one that is neither leaks, and each may be
+ * joined only once. Returns 0 on success and -1 if t is NULL, the caller,
+ * detached or already being joined.
+ */
+int minithread_join(minithread_t *t, int *retval);
+
+/*
+ * Let thread t be freed as soon as it finishes, without being joined.
+ * The caller must not use t after joining or detaching it.
+ */
+void minithread_detach(minithread_t *t);
+
+/*
+ * Return an empty queue of minithreads. Threads are linked through a node
+ * inside their control block, so the queue never allocates. A thread can be
+ * in only one such queue at a time (ready, waiting or finished).
+ */
+queue_t* minithread_queue_new();
+
 /*
  * Return identity (minithread_t) of caller thread.
  */
@@ -43,15 +131,38 @@ minithread_t* minithread_self();
 int minithread_id();
 
 /*
- * Block the calling thread.
+ * Block the calling thread. A thread started since it queued itself for a
+ * wakeup goes on instead.
  */
 void minithread_stop();
 
 /*
- * Make t runnable.
+ * Make t runnable. t may be started once it has queued itself for a
+ * wakeup, even before it calls minithread_stop.
  */
 void minithread_start(minithread_t *t);
 
+/*
+ * Make t runnable and switch to it at once, on the caller's CPU. The caller
+ * goes to the end of its ready list as if it yielded, but is not charged a
+ * quantum. Must not be called from an interrupt handler.
+ */
+void minithread_handoff(minithread_t *t);
+
+/*
+ * Priority inheritance, used by the owner-tracking locks in synch.h. A
+ * thread is queued at the better (lower) of the ready list level it would
+ * get anyway and the level it inherited. minithread_level returns the level
+ * a thread is queued at or last ran from, and minithread_inherit_level sets
+ * the inherited one (MINITHREAD_LEVELS for none), moving the thread if it
+ * is on a ready list. The other two give the lock code a place in each
+ * thread to note the mutex it waits for and the mutexes it holds.
+ */
+int minithread_level(minithread_t *t);
+void minithread_inherit_level(minithread_t *t, int level);
+struct mutex** minithread_mutex_waiting(minithread_t *t);
+struct mutex** minithread_mutexes_held(minithread_t *t);
+
 /*
  * Forces the caller to relinquish the processor and be put to the end of
  * the ready queue.  Allows another thread to run.
@@ -66,11 +177,94 @@ void minithread_yield();
  */
 void minithread_system_initialize(proc_t mainproc, arg_t mainarg);
 
+/*
+ * Set the number of virtual CPUs, each driven by its own host thread. Must be
+ * called before minithread_system_initialize; the default is 1. Every CPU has
+ * its own ready list, idle CPUs steal work from busy ones, and threads made
+ * runnable are placed on an idle CPU when there is one.
+ */
+void minithread_set_cpus(int ncpus);
+
+/*
+ * Choose the scheduler policy, one of those in scheduler.h. Must be called
+ * before minithread_system_initialize; the default is sched_mlfq.
+ */
+void minithread_set_scheduler(struct sched_ops *ops);
+
+/*
+ * Make t a real-time thread that needs budget nanoseconds of CPU time in
+ * every period nanoseconds, the first of which begins now; a period of 0
+ * makes it an ordinary thread again. Real-time threads run ahead of all
+ * others, earliest deadline (end of period) first, and one waking up from
+ * a sleep at once preempts a thread with a later deadline or none. One that
+ * used up its budget runs as an ordinary thread until its next period. A
+ * thread ends the job of a period by sleeping (minithread_sleep_*); not
+ * doing so by the deadline counts as a deadline miss in minithread_stats.
+ *
+ * Each real-time thread is admitted on one CPU, where its budget / period
+ * is added up with those of the others there, and it runs only on that CPU
+ * while in the real-time class. Returns 0, or -1 if budget > period or no
+ * CPU has room for t, as its total would exceed 1.
+ */
+int minithread_set_deadline(minithread_t *t, uint64_t period, uint64_t budget);
+
+/*
+ * Set the share of the CPU thread t gets relative to other threads of its
+ * group, under the policies that weigh threads (stride and cfs). The default is
+ * SCHED_WEIGHT_DEFAULT; a thread of twice that weight gets twice the time.
+ */
+void minithread_set_weight(minithread_t *t, int weight);
+
+/*
+ * Thread groups, like cgroups. Every thread is in a group, by default that
+ * of the thread that created it; threads created by the system go into a
+ * default group of weight SCHED_WEIGHT_DEFAULT. The CPU is shared between
+ * groups by weight first, as under cfs, and between the threads of a group
+ * by the policy second, so a group forking many threads gets no more than
+ * its share. A group with a quota also gets at most quota nanoseconds of
+ * CPU time, summed over all CPUs, in every period nanoseconds; after that
+ * its threads wait until the period ends. Real-time threads run first
+ * regardless of their group, but their time counts against it. Groups are
+ * shared out on each CPU; idle CPUs steal threads regardless of group. CPUs
+ * other than CPU 0 notice a group out of quota at their next clock tick,
+ * and time it ran over is taken from its next periods.
+ *
+ * minithread_group_create returns a new group of the given weight, or NULL
+ * on failure. It must be called after minithread_system_initialize, and
+ * groups are never freed. minithread_group_set_quota sets the quota, 0 for
+ * none (the default), and returns -1 if period is 0 with a quota.
+ * minithread_set_group moves t into g, and returns -1 if g is NULL or t
+ * exited. minithread_group_stats fills in the statistics of g.
+ */
+minithread_group_t* minithread_group_create(int weight);
+void minithread_group_set_weight(minithread_group_t *g, int weight);
+int minithread_group_set_quota(minithread_group_t *g, uint64_t quota,
+                               uint64_t period);
+minithread_group_t* minithread_group(minithread_t *t);
+int minithread_set_group(minithread_t *t, minithread_group_t *g);
+void minithread_group_stats(minithread_group_t *g,
+                            minithread_group_stats_t *stats);
+
+/*
+ * Fill in the scheduler statistics of thread t (NULL for none) and the
+ * run-queue latency histograms of the whole system. The bookkeeping costs
+ * one cycle counter read per context switch and is always on.
+ */
+void minithread_stats(minithread_t *t, minithread_stats_t *stats);
+
 /*
  * sleep with timeout in microseconds
  */
 void minithread_sleep_with_timeout(int delay);
 
+/*
+ * Sleep until monotonic time deadline, in nanoseconds (see
+ * minithread_clock_now in interrupts.h), or for delay nanoseconds. The
+ * wakeup is driven by a one-shot timer, so it is not rounded to clock ticks.
+ */
+void minithread_sleep_until(uint64_t deadline);
+void minithread_sleep_for(uint64_t delay);
+
 
 #endif /*__MINITHREAD_H__*/
 
@@ -8,13 +8,39 @@
 #include "queue.h"
 #include "multilevel_queue.h"
 
+#define BITS_PER_WORD (8 * sizeof(unsigned long))
+#define BITMAP_WORDS(levels) (((levels) + BITS_PER_WORD - 1) / BITS_PER_WORD)
+
 struct multilevel_queue {
     int length;
     int total_level;
     queue_t **mul_queue;
+    unsigned long *bitmap;      // bit i is set iff level i is non-empty
 };
 
-multilevel_queue_t* multilevel_queue_new(int number_of_levels) {
+/*
+ * Return the first non-empty level in [from, to), or -1 if there is none.
+ * Takes one find-first-set per bitmap word.
+ */
+static int multilevel_queue_find(multilevel_queue_t *queue, int from, int to) {
+    int w = from / BITS_PER_WORD;
+    int last = (to - 1) / BITS_PER_WORD;
+    unsigned long word;
+
+    if (from >= to)
+        return -1;
+    word = queue -> bitmap[w] & (~0UL << (from % BITS_PER_WORD));
+    while (word == 0) {
+        if (++w > last)
+            return -1;
+        word = queue -> bitmap[w];
+    }
+    int level = w * BITS_PER_WORD + __builtin_ctzl(word);
+    return level < to ? level : -1;
+}
+
+/* Create a multilevel queue whose levels are intrusive if link >= 0 */
+static multilevel_queue_t* multilevel_queue_create(int number_of_levels, int link) {
     if (number_of_levels < 0) 
         return NULL;
 
@@ -26,21 +52,27 @@ multilevel_queue_t* multilevel_queue_new(int number_of_levels) {
     m_q -> length = 0;
     m_q -> total_level = number_of_levels;
     m_q -> mul_queue = (queue_t **) malloc(sizeof(queue_t *) * number_of_levels); 
-    if (m_q -> mul_queue == NULL) {
+    // One spare word so the bitmap is never zero-sized
+    m_q -> bitmap = (unsigned long *) calloc(BITMAP_WORDS(number_of_levels) + 1, 
+        sizeof(unsigned long));
+    if (m_q -> mul_queue == NULL || m_q -> bitmap == NULL) {
         fprintf(stderr, "Failed to allocate memory for each queue\n");
+        free(m_q -> mul_queue);
+        free(m_q -> bitmap);
         free(m_q);
         return NULL;
     }
 
     int i, j;
     for (i = 0; i < number_of_levels; i++) {
-        m_q -> mul_queue[i] = queue_new();
+        m_q -> mul_queue[i] = link >= 0 ? queue_new_intrusive(link) : queue_new();
         if (m_q -> mul_queue[i] == NULL) {
             fprintf(stderr, "Failed to create new queue\n");
             for (j = 0; j < i; j++) { 
                 free(m_q -> mul_queue[j]); 
             }
             free(m_q -> mul_queue);
+            free(m_q -> bitmap);
             free(m_q);
             return NULL;
         }
@@ -48,6 +80,16 @@ multilevel_queue_t* multilevel_queue_new(int number_of_levels) {
     return m_q;
 }
 
+multilevel_queue_t* multilevel_queue_new(int number_of_levels) {
+    return multilevel_queue_create(number_of_levels, -1);
+}
+
+multilevel_queue_t* multilevel_queue_new_intrusive(int number_of_levels, int link) {
+    if (link < 0)
+        return NULL;
+    return multilevel_queue_create(number_of_levels, link);
+}
+
 int multilevel_queue_enqueue(multilevel_queue_t *queue, int level, void* item) {
     if (queue == NULL || level < 0 || level >= queue -> total_level 
         || item == NULL) 
@@ -57,6 +99,7 @@ int multilevel_queue_enqueue(multilevel_queue_t *queue, int level, void* item) {
         fprintf(stderr, "Failed to append to the queue");
         return -1;
     }
+    queue -> bitmap[level / BITS_PER_WORD] |= 1UL << (level % BITS_PER_WORD);
     queue -> length++;
     return 0;
 }
@@ -66,24 +109,30 @@ int multilevel_queue_dequeue(multilevel_queue_t *queue, int level, void** item)
         level >= queue -> total_level || item == NULL) 
         return -1;
 
-    int i = level;
-    while (i < queue -> total_level) {
-        if (queue_dequeue(queue -> mul_queue[i], item) == 0) {
-            queue -> length--;
-            return i;
-        }
-        i++;
+    // Search from level to the last level, then wrap around
+    int i = multilevel_queue_find(queue, level, queue -> total_level);
+    if (i == -1)
+        i = multilevel_queue_find(queue, 0, level);
+    if (i == -1 || queue_dequeue(queue -> mul_queue[i], item) == -1) {
+        *item = NULL;
+        return -1;
     }
+    if (queue_length(queue -> mul_queue[i]) == 0)
+        queue -> bitmap[i / BITS_PER_WORD] &= ~(1UL << (i % BITS_PER_WORD));
+    queue -> length--;
+    return i;
+}
 
-    i = 0;
-    while (i < level) {
-        if (queue_dequeue(queue->mul_queue[i], item) == 0) {
-            queue -> length--;
-            return i;
-        }
-        i++;
-    }
-    return -1;
+int multilevel_queue_delete(multilevel_queue_t *queue, int level, void* item) {
+    if (queue == NULL || level < 0 || level >= queue -> total_level) 
+        return -1;
+
+    if (queue_delete(queue -> mul_queue[level], item) == -1)
+        return -1;
+    if (queue_length(queue -> mul_queue[level]) == 0)
+        queue -> bitmap[level / BITS_PER_WORD] &= ~(1UL << (level % BITS_PER_WORD));
+    queue -> length--;
+    return 0;
 }
 
 int multilevel_queue_free(multilevel_queue_t *queue) {
@@ -95,6 +144,7 @@ int multilevel_queue_free(multilevel_queue_t *queue) {
         queue_free(queue -> mul_queue[i]);
     }
     free(queue -> mul_queue);
+    free(queue -> bitmap);
     free(queue);
     return 0;
 }
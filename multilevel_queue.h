@@ -17,6 +17,13 @@ typedef struct multilevel_queue multilevel_queue_t;
  */
 multilevel_queue_t* multilevel_queue_new(int number_of_levels);
 
+/*
+ * Like multilevel_queue_new, but every level is an intrusive queue whose items
+ * embed a node_t at byte offset link (see queue_new_intrusive), so enqueue and
+ * dequeue never allocate.
+ */
+multilevel_queue_t* multilevel_queue_new_intrusive(int number_of_levels, int link);
+
 /* 
  * Appends a void* to the multilevel queue at the specified level.
  * Return 0 (success) or -1 (failure).
@@ -29,9 +36,18 @@ int multilevel_queue_enqueue(multilevel_queue_t* queue, int level, void* item);
  * in the multilevel queue, an item should be returned. Return the level that
  * the item was located on and that item. If the multilevel queue is empty,
  * return -1 (failure) with a NULL item.
+ *
+ * Non-empty levels are tracked in a bitmap, so finding the level costs one
+ * find-first-set per 64 levels rather than a probe of every empty level.
  */
 int multilevel_queue_dequeue(multilevel_queue_t* queue, int level, void** item);
 
+/*
+ * Remove item from the given level of the multilevel queue. Return 0 if it
+ * was there, or -1 otherwise.
+ */
+int multilevel_queue_delete(multilevel_queue_t* queue, int level, void* item);
+
 /*
  * Free the queue and return 0 (success) or -1 (failure).
  * Do not free queue nodes; this is the responsibility of the programmer.
@@ -39,7 +55,9 @@ int multilevel_queue_dequeue(multilevel_queue_t* queue, int level, void** item);
 int multilevel_queue_free(multilevel_queue_t* queue);
 
 /*
- * Get the queue at level and return that queue if success or NULL if failure
+ * Get the queue at level and return that queue if success or NULL if failure.
+ * The returned queue is for inspection only; adding or removing items through
+ * it bypasses the bitmap of non-empty levels.
  */
 queue_t* multilevel_queue_getq(multilevel_queue_t* queue, int level);
 
@@ -7,6 +7,7 @@
  *      This module paints the unix socket interface a pretty color.
  */
 
+#define _GNU_SOURCE
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -18,12 +19,14 @@
 #include <signal.h>
 #include <unistd.h>
 #include <ctype.h>
+#include <sched.h>
 
 #include "defs.h"
 #include "network.h"
 #include "interrupts_private.h"
 #include "minithread.h"
 #include "random.h"
+#include "trace.h"
 
 #define BCAST_ENABLED 0
 #define BCAST_USE_TOPOLOGY_FILE 0
@@ -70,12 +73,54 @@ bool synthetic_network = false;
 struct address_info {
   int sock;
   struct sockaddr_in sin;
-  char pkt[MAX_NETWORK_PKT_SIZE];
 };
 
 struct address_info if_info;
 static network_address_t broadcast_addr = { 0 };
 
+/*
+ * Received packets, passed from the poll thread to the network handler.
+ * Only the poll thread advances ring_tail and only the handler (which runs
+ * with interrupts disabled, so on one CPU at a time) advances ring_head, so
+ * the ring needs no lock. The poll thread raises a network interrupt only
+ * when ring_signalled was clear, and the handler clears it once it finds
+ * the ring empty, so a batch of packets costs one interrupt.
+ */
+#define NETWORK_RING_SIZE 256       /* a power of 2 */
+
+static network_interrupt_arg_t ring[NETWORK_RING_SIZE];
+static volatile unsigned int ring_head = 0;
+static volatile unsigned int ring_tail = 0;
+static volatile int ring_signalled = 0;
+static int ring_taken = 0;          /* the handler has ring[ring_head] */
+
+/*
+ * The poll thread receives up to recv_batch packets per system call, see
+ * network_recv_batch.
+ */
+#define NETWORK_BATCH 32
+#define NETWORK_BATCH_MAX 64
+
+static unsigned int recv_batch = NETWORK_BATCH;
+
+/*
+ * The transmit queue, off unless network_tx_queue turns it on. Packets are
+ * copied in, and sent together with one sendmmsg when it is full or when
+ * the CPU switches threads (network_flush). It is only used with interrupts
+ * disabled, so it needs no lock of its own.
+ */
+#define NETWORK_TX_MAX 64
+
+typedef struct {
+  struct sockaddr_in sin;
+  int len;
+  char pkt[MAX_NETWORK_PKT_SIZE];
+} tx_slot_t;
+
+static tx_slot_t* tx_queue = NULL;
+static int tx_size = 0;
+static int tx_len = 0;
+
 /* forward definition */
 void start_network_poll(interrupt_handler_t, int*);
 void network_address_to_sockaddr(const network_address_t addr, struct sockaddr_in* sin);
@@ -106,61 +151,147 @@ network_printaddr(network_address_t addr) {
   printf("%s", name);
 }
 
+/* Put a packet on the transmit queue, and send the queue if it is full */
 static int
-send_pkt(const network_address_t dest_address,
-         int hdr_len, const char* hdr,
-         int data_len, const char* data) {
-  int cc;
+tx_enqueue(const network_address_t dest_address,
+           const struct iovec* iov, int iovcnt, int pktlen) {
+  interrupt_level_t old_level = set_interrupt_level(DISABLED);
+  tx_slot_t* slot = &tx_queue[tx_len++];
+  char* bufp = slot->pkt;
+  int i;
+
+  for (i = 0; i < iovcnt; i++) {
+    memcpy(bufp, iov[i].iov_base, iov[i].iov_len);
+    bufp += iov[i].iov_len;
+  }
+  slot->len = pktlen;
+  network_address_to_sockaddr(dest_address, &slot->sin);
+  if (tx_len >= tx_size)
+    network_flush();
+  set_interrupt_level(old_level);
+  return pktlen;
+}
+
+void
+network_flush() {
+  struct mmsghdr msgs[NETWORK_TX_MAX];
+  struct iovec iovs[NETWORK_TX_MAX];
+  interrupt_level_t old_level;
+  int i, n, sent = 0;
+
+  if (tx_len == 0)
+    return;
+
+  old_level = set_interrupt_level(DISABLED);
+  for (i = 0; i < tx_len; i++) {
+    iovs[i].iov_base = tx_queue[i].pkt;
+    iovs[i].iov_len = tx_queue[i].len;
+    memset(&msgs[i].msg_hdr, 0, sizeof(msgs[i].msg_hdr));
+    msgs[i].msg_hdr.msg_name = &tx_queue[i].sin;
+    msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+    msgs[i].msg_hdr.msg_iov = &iovs[i];
+    msgs[i].msg_hdr.msg_iovlen = 1;
+  }
+
+  /* A packet that cannot be sent is lost, as any datagram may be */
+  while (sent < tx_len) {
+    n = sendmmsg(if_info.sock, msgs + sent, tx_len - sent, 0);
+    if (n <= 0)
+      break;
+    sent += n;
+  }
+  tx_len = 0;
+  set_interrupt_level(old_level);
+}
+
+/*
+ * Send the packet made of the iovcnt segments in iov, straight from where
+ * they are: the socket gathers them, so nothing is copied.
+ */
+static int
+send_pktv(const network_address_t dest_address,
+          const struct iovec* iov, int iovcnt) {
   struct sockaddr_in sin;
-  char* bufp;
-  int sz, pktlen;
+  struct msghdr msg;
+  int i, pktlen = 0;
 
-  pktlen = hdr_len + data_len;
+  for (i = 0; i < iovcnt; i++)
+    pktlen += iov[i].iov_len;
 
   /* sanity checks */
-  if (hdr_len < 0 || data_len < 0 || pktlen > MAX_NETWORK_PKT_SIZE)
+  if (pktlen > MAX_NETWORK_PKT_SIZE)
     return 0;
 
-  /*
-   * Pull up the headers and data and stuff them into the output
-   * packet with the
-   * field sizes embedded.
-   */
+  if (tx_size > 0)
+    return tx_enqueue(dest_address, iov, iovcnt, pktlen);
+
+  network_address_to_sockaddr(dest_address, &sin);
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_name = &sin;
+  msg.msg_namelen = sizeof(sin);
+  msg.msg_iov = (struct iovec *) iov;
+  msg.msg_iovlen = iovcnt;
 
-  bufp = if_info.pkt;
+  return sendmsg(if_info.sock, &msg, 0);
+}
 
-  sz = hdr_len;
-  memcpy(bufp, hdr, sz);
-  bufp += sz;
+static int
+send_pkt(const network_address_t dest_address,
+         int hdr_len, const char* hdr,
+         int data_len, const char* data) {
+  struct iovec iov[2];
 
-  sz = data_len;
-  memcpy(bufp, data, sz);
-  bufp += sz;
+  /* sanity checks */
+  if (hdr_len < 0 || data_len < 0)
+    return 0;
 
-  network_address_to_sockaddr(dest_address, &sin);
-  cc = sendto(if_info.sock,
-              if_info.pkt,
-              pktlen,
-              0,
-              (struct sockaddr *) &sin,
-              sizeof(sin));
-
-  return cc;
+  iov[0].iov_base = (char *) hdr;
+  iov[0].iov_len = hdr_len;
+  iov[1].iov_base = (char *) data;
+  iov[1].iov_len = data_len;
+  return send_pktv(dest_address, iov, 2);
 }
 
 int
 network_send_pkt(const network_address_t dest_address, int hdr_len,
                  const char* hdr, int data_len, const char* data) {
+  struct iovec iov;
+
+  /* sanity checks */
+  if (hdr_len < 0 || data_len < 0)
+    return 0;
+
+  iov.iov_base = (char *) data;
+  iov.iov_len = data_len;
+  return network_send_pktv(dest_address, hdr_len, hdr, 1, &iov);
+}
+
+int
+network_send_pktv(const network_address_t dest_address, int hdr_len,
+                  const char* hdr, int iovcnt, const struct iovec* iov) {
+  struct iovec segments[NETWORK_MAX_SEGMENTS + 1];
+  int i, pktlen = hdr_len;
+
+  /* sanity checks */
+  if (hdr_len < 0 || iovcnt < 0 || iovcnt > NETWORK_MAX_SEGMENTS)
+    return 0;
+
+  segments[0].iov_base = (char *) hdr;
+  segments[0].iov_len = hdr_len;
+  for (i = 0; i < iovcnt; i++) {
+    segments[i + 1] = iov[i];
+    pktlen += iov[i].iov_len;
+  }
 
   if (synthetic_network) {
     if(genrand() < loss_rate)
-      return (hdr_len+data_len);
+      return pktlen;
 
     if(genrand() < duplication_rate)
-      send_pkt(dest_address, hdr_len, hdr, data_len, data);
+      send_pktv(dest_address, segments, iovcnt + 1);
   }
 
-  return send_pkt(dest_address, hdr_len, hdr, data_len, data);
+  return send_pktv(dest_address, segments, iovcnt + 1);
 }
 
 void
@@ -243,6 +374,28 @@ network_udp_ports(short myportnum, short otherportnum) {
   other_udp_port = otherportnum;
 }
 
+void
+network_tx_queue(int n) {
+  if (n > NETWORK_TX_MAX)
+    n = NETWORK_TX_MAX;
+  if (n > 0 && tx_queue == NULL) {
+    tx_queue = (tx_slot_t *) malloc(NETWORK_TX_MAX * sizeof(tx_slot_t));
+    assert(tx_queue != NULL);
+  }
+  /* Send what is queued, so a smaller queue does not start out overfull */
+  network_flush();
+  tx_size = n > 0 ? n : 0;
+}
+
+void
+network_recv_batch(int n) {
+  if (n < 1)
+    n = 1;
+  if (n > NETWORK_BATCH_MAX)
+    n = NETWORK_BATCH_MAX;
+  recv_batch = n;
+}
+
 void
 network_synthetic_params(double loss, double duplication) {
   synthetic_network = true;
@@ -416,43 +569,92 @@ network_remove_bcast_link(char* src, char* dest) {
 }
 
 
+network_interrupt_arg_t*
+network_next_pkt() {
+  /* The handler is done with the packet we gave it last */
+  if (ring_taken) {
+    __sync_synchronize();
+    ring_head++;
+    ring_taken = 0;
+  }
+
+  if (ring_head == ring_tail) {
+    /* The next packet raises an interrupt, unless we see it here */
+    __sync_fetch_and_and(&ring_signalled, 0);
+    if (ring_head == ring_tail)
+      return NULL;
+  }
+  __sync_synchronize();
+  ring_taken = 1;
+  return &ring[ring_head & (NETWORK_RING_SIZE - 1)];
+}
+
 int network_poll(void* arg) {
   int* s;
   network_interrupt_arg_t* packet;
-  struct sockaddr_in addr;
-  unsigned int fromlen = sizeof(struct sockaddr_in);
+  struct mmsghdr msgs[NETWORK_BATCH_MAX];
+  struct iovec iovs[NETWORK_BATCH_MAX];
+  struct sockaddr_in addrs[NETWORK_BATCH_MAX];
+  unsigned int first, room;
+  int i, n;
 
   s = (int *) arg;
+  trace_attach("network");
 
   while(true) {
 
-    /* we rely on run_user_handler to destroy this data structure */
-    if (DEBUG)
-      kprintf("NET:Allocating an incoming packet.\n");
+    /* the ring is full, wait for the handler to take some */
+    while (ring_tail - ring_head == NETWORK_RING_SIZE)
+      sched_yield();
 
-    packet =
-      (network_interrupt_arg_t *) malloc(sizeof(network_interrupt_arg_t));
-    assert(packet != NULL);
+    /*
+     * Receive straight into the free slots, as many as recv_batch, up to
+     * the end of the ring. Block for the first packet only.
+     */
+    first = ring_tail & (NETWORK_RING_SIZE - 1);
+    room = NETWORK_RING_SIZE - (ring_tail - ring_head);
+    if (room > NETWORK_RING_SIZE - first)
+      room = NETWORK_RING_SIZE - first;
+    if (room > recv_batch)
+      room = recv_batch;
+    for (i = 0; i < room; i++) {
+      iovs[i].iov_base = ring[first + i].buffer;
+      iovs[i].iov_len = MAX_NETWORK_PKT_SIZE;
+      memset(&msgs[i].msg_hdr, 0, sizeof(msgs[i].msg_hdr));
+      msgs[i].msg_hdr.msg_name = &addrs[i];
+      msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+      msgs[i].msg_hdr.msg_iov = &iovs[i];
+      msgs[i].msg_hdr.msg_iovlen = 1;
+    }
 
-    packet->size = recvfrom(*s, packet->buffer, MAX_NETWORK_PKT_SIZE,
-                            0, (struct sockaddr *) &addr, &fromlen);
-    if (packet->size <= 0) {
+    n = recvmmsg(*s, msgs, room, MSG_WAITFORONE, NULL);
+    if (n <= 0) {
       kprintf("NET:Error, %d.\n", errno);
       AbortOnCondition(1,"Crashing.");
     }
-    else if (DEBUG)
-      kprintf("NET:Received a packet, seqno %d.\n", ntohl(*((int *) packet->buffer)));
 
-    assert(fromlen == sizeof(struct sockaddr_in));
-    sockaddr_to_network_address(&addr, packet->sender);
+    for (i = 0; i < n; i++) {
+      packet = &ring[first + i];
+      packet->size = msgs[i].msg_len;
+      if (DEBUG)
+        kprintf("NET:Received a packet, seqno %d.\n", ntohl(*((int *) packet->buffer)));
+      assert(msgs[i].msg_hdr.msg_namelen == sizeof(struct sockaddr_in));
+      sockaddr_to_network_address(&addrs[i], packet->sender);
+    }
+    packet = &ring[first];
 
     /*
-     * now we have filled in the arg to the network interrupt service routine,
-     * so we have to get the user's thread to run it.
+     * now we have filled in the args to the network interrupt service
+     * routine, so we have to get the user's thread to run it, unless it has
+     * not yet run for the packets before, in which case it takes these too.
      */
-    if (DEBUG)
-      kprintf("NET:packet arrived.\n");
-    send_interrupt(NETWORK_INTERRUPT_TYPE, mini_network_handler, (void*)packet);
+    __sync_synchronize();
+    ring_tail += n;
+    if (__sync_bool_compare_and_swap(&ring_signalled, 0, 1)) {
+      if (DEBUG)
+        kprintf("NET:packet arrived.\n");
+      send_interrupt(NETWORK_INTERRUPT_TYPE, mini_network_handler, (void*)packet);
+    }
   }
 }
 
@@ -478,9 +680,7 @@ void start_network_poll(interrupt_handler_t network_handler, int* s) {
   sa.sa_handler = (void*)handle_interrupt;
   sa.sa_flags = SA_SIGINFO | SA_RESTART | SA_ONSTACK;
   sa.sa_sigaction= (void*)handle_interrupt;
-  sigemptyset(&sa.sa_mask);
-  sigaddset(&sa.sa_mask,SIGRTMAX-2);
-  sigaddset(&sa.sa_mask,SIGRTMAX-1);
+  interrupt_signals(&sa.sa_mask);
   if (sigaction(SIGRTMAX-2, &sa, NULL) == -1)
       AbortOnError(0);
 
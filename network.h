@@ -15,6 +15,8 @@
  *      same or different hosts.
  */
 
+#include <sys/uio.h>
+
 #define MAX_NETWORK_PKT_SIZE    8192
 
 /* network_address_t's should be treated as opaque types. See functions below */
@@ -31,10 +33,20 @@ typedef struct {
     int size;
 } network_interrupt_arg_t;
 
-/* the type of an interrupt handler.  These functions are responsible for freeing
- * the argument that is passed in */
+/*
+ * the type of an interrupt handler. Packets arrive in batches: the handler is
+ * called once for any number of them, with the first, and must take every
+ * one with network_next_pkt, until it returns NULL, before it returns.
+ */
 typedef void (*network_handler_t)(network_interrupt_arg_t *arg);
 
+/*
+ * Returns the next packet that arrived, or NULL if there is none left. Call
+ * it with interrupts disabled. The packet belongs to the network layer and
+ * is only valid until the next call, so copy out what you keep.
+ */
+network_interrupt_arg_t* network_next_pkt();
+
 /*
  * network_initialize should be called before clock interrupts start
  * happening (or with clock interrupts disabled).  The initialization
@@ -56,6 +68,13 @@ int network_initialize(network_handler_t network_handler);
  */
 void network_udp_ports(short myportnum, short otherportnum);
 
+/*
+ * sets how many packets the network poll thread takes from the socket with
+ * each system call, at most 64 (default 32). Call it before
+ * network_initialize. A batch of 1 receives each packet with its own call.
+ */
+void network_recv_batch(int n);
+
 
 /*******************************************************************************
 *  Functions for sending packets                                               *
@@ -63,13 +82,42 @@ void network_udp_ports(short myportnum, short otherportnum);
 
 /*
  * network_send_pkt returns the number of bytes sent if it was able to
- * successfully send the data.  Returns -1 otherwise.
+ * successfully send the data, 0 if the lengths are invalid or the packet
+ * is too big, and -1 if the host could not send it.
  */
 int
 network_send_pkt(const network_address_t dest_address,
                  int hdr_len, const char * hdr,
                  int  data_len, const char * data);
 
+/*
+ * network_send_pktv sends a packet made of the header and the iovcnt data
+ * segments in iov, at most NETWORK_MAX_SEGMENTS, in that order. They are
+ * sent from where they are, without being copied together first. Returns
+ * as network_send_pkt, and 0 for more segments.
+ */
+#define NETWORK_MAX_SEGMENTS 15
+
+int
+network_send_pktv(const network_address_t dest_address,
+                  int hdr_len, const char * hdr,
+                  int iovcnt, const struct iovec * iov);
+
+/*
+ * network_tx_queue turns on the transmit queue, which holds up to n packets
+ * (at most 64), or turns it off if n is 0, the default. Call it before
+ * network_initialize. With the queue on, network_send_pkt copies the packet
+ * to it and returns; the queue is sent with one system call when it is full
+ * and whenever a CPU switches threads, so at the latest when the sender's
+ * quantum ends. A packet that cannot be sent then is lost.
+ */
+void network_tx_queue(int n);
+
+/*
+ * network_flush sends every packet on the transmit queue now.
+ */
+void network_flush();
+
 
 /*******************************************************************************
 *  Functions for working with network addresses                                *
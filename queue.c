@@ -7,18 +7,45 @@
 
 #include "queue.h"
 
-struct node {
-    struct node* previous;
-    struct node* next;
-    void* item;
-};
-
 struct queue {
     node_t* head;
     node_t* tail;
     int size;
+    int link;       // offset of the node inside items, -1 if nodes are allocated
 };
 
+/* Get the node for item, either embedded in the item or newly allocated */
+static node_t* queue_node_get(queue_t *queue, void* item) {
+    if (queue -> link >= 0)
+        return (node_t *) ((char *) item + queue -> link);
+    return (node_t *) malloc(sizeof(node_t));
+}
+
+/* Give back a node that is no longer linked into queue */
+static void queue_node_put(queue_t *queue, node_t *node) {
+    if (queue -> link >= 0) {
+        node -> previous = NULL;
+        node -> next = NULL;
+        node -> queue = NULL;
+    } else {
+        free(node);
+    }
+}
+
+/* Unlink node from queue */
+static void queue_unlink(queue_t *queue, node_t *node) {
+    if (node -> previous != NULL)
+        node -> previous -> next = node -> next;
+    else
+        queue -> head = node -> next;
+    if (node -> next != NULL)
+        node -> next -> previous = node -> previous;
+    else
+        queue -> tail = node -> previous;
+    (queue -> size)--;
+    queue_node_put(queue, node);
+}
+
 void* queue_peek(queue_t *q) {
     if (q == NULL || q -> head == NULL)
         return NULL;
@@ -32,17 +59,33 @@ queue_t* queue_new() {
     tQueue -> head = NULL;
     tQueue -> tail = NULL;
     tQueue -> size = 0; 
+    tQueue -> link = -1;
+    return tQueue;
+}
+
+queue_t* queue_new_intrusive(int link) {
+    if (link < 0)
+        return NULL;
+
+    queue_t *tQueue = queue_new();
+    if (tQueue == NULL) 
+        return NULL;
+    tQueue -> link = link;
     return tQueue;
 }
 
 int queue_prepend(queue_t *queue, void* item) {
-    node_t *node = (node_t *) malloc(sizeof(node_t));
-    if (node == NULL || queue == NULL || item == NULL) 
+    if (queue == NULL || item == NULL) 
+        return -1;
+
+    node_t *node = queue_node_get(queue, item);
+    if (node == NULL) 
         return -1;
 
     node -> previous = NULL;
     node -> next = queue -> head;
     node -> item = item;
+    node -> queue = queue;
     if (queue -> head != NULL)
         queue -> head -> previous = node;
     else
@@ -56,13 +99,14 @@ int queue_append(queue_t *queue, void* item) {
     if (queue == NULL || item == NULL)
         return -1;
 
-    node_t *node = (node_t *) malloc(sizeof(node_t));
+    node_t *node = queue_node_get(queue, item);
     if (node == NULL) 
         return -1;
     
     node -> next = NULL;
     node -> previous = queue -> tail;
     node -> item = item;
+    node -> queue = queue;
     if (queue -> tail != NULL)
         queue -> tail -> next = node;
     else
@@ -82,14 +126,7 @@ int queue_dequeue(queue_t *queue, void** item) {
     }
 
     *item = queue -> head -> item;
-    if (queue -> size == 1) {
-        queue -> head = NULL;
-        queue -> tail = NULL;
-    } else if (queue -> size > 1) {
-        queue -> head = queue -> head -> next;
-        queue -> head -> previous = NULL;
-    }   
-    (queue -> size)--;
+    queue_unlink(queue, queue -> head);
     return 0;
 }
 
@@ -125,24 +162,19 @@ int queue_delete(queue_t *queue, void* item) {
     if (queue == NULL || item == NULL) 
         return -1;
 
+    // An intrusive node knows which queue, if any, it is linked into
+    if (queue -> link >= 0) {
+        node_t *node = (node_t *) ((char *) item + queue -> link);
+        if (node -> queue != queue)
+            return -1;
+        queue_unlink(queue, node);
+        return 0;
+    }
+
     node_t *curr = queue -> head;
     while (curr != NULL) {
         if (curr -> item == item) {
-            if (queue -> size == 1) {
-                queue -> head = NULL;
-                queue -> tail = NULL;
-            } else if (curr == queue -> head) {
-                curr -> next -> previous = NULL;
-                queue -> head = curr -> next;
-            } else if (curr == queue -> tail) {
-                curr -> previous -> next = NULL;
-                queue -> tail = curr -> previous;
-            } else {
-                curr -> previous -> next = curr -> next;
-                curr -> next -> previous = curr -> previous;
-            }
-            free(curr);
-            (queue -> size)--;
+            queue_unlink(queue, curr);
             return 0;
         }
         curr = curr -> next;
@@ -155,10 +187,13 @@ int queue_sorted_insert(queue_t* queue, void* item, comp_t f) {
         return -1;
 
     node_t *curr = queue -> head;
-    node_t *new = (node_t *) malloc(sizeof(node_t));
+    node_t *new = queue_node_get(queue, item);
+    if (new == NULL) 
+        return -1;
     new -> item = item;
     new -> previous = NULL;
     new -> next = NULL;
+    new -> queue = queue;
     if (curr == NULL) 
         queue -> head = new;
     (queue -> size)++;
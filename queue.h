@@ -10,6 +10,19 @@
 typedef struct node node_t;
 typedef struct queue queue_t;
 
+/*
+ * A queue link. Ordinary queues allocate one node per item; items placed in
+ * an intrusive queue embed their own node_t instead (see queue_new_intrusive),
+ * which must start out zeroed. queue is the queue the node is linked into,
+ * NULL if none.
+ */
+struct node {
+    struct node* previous;
+    struct node* next;
+    void* item;
+    struct queue* queue;
+};
+
 /*
  * Returns the first element in the queue but does not dequeue it. 
  */
@@ -20,6 +33,14 @@ void* queue_peek(queue_t*);
  */
 queue_t* queue_new();
 
+/*
+ * Return an empty intrusive queue.  Returns NULL on error.
+ * Every item carries its own node_t at byte offset link (use offsetof), so
+ * adding and removing items never allocates and queue_delete takes constant
+ * time. An item may be in at most one queue through the same node at a time.
+ */
+queue_t* queue_new_intrusive(int link);
+
 /*
  * Prepend a void* to a queue (both specified as parameters).
  * Returns 0 (success) or -1 (failure).
@@ -61,7 +82,8 @@ int queue_length(const queue_t* queue);
 
 /*
  * Delete the first instance of the specified item from the given queue.
- * Returns 0 if an element was deleted, or -1 otherwise.
+ * Returns 0 if an element was deleted, or -1 otherwise, in particular if
+ * the item is in another queue.
  */
 int queue_delete(queue_t* queue, void* item);
 
@@ -0,0 +1,381 @@
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "interrupts.h"
+#include "minithread.h"
+#include "multilevel_queue.h"
+#include "queue.h"
+#include "scheduler.h"
+
+#define STRIDE_ONE (1 << 20)    // pass advance of a thread of weight 1
+#define CFS_SLEEPER_BONUS (3 * MILLISECOND)
+
+static void sched_init(sched_entity_t *se) {
+    memset(se, 0, sizeof(*se));
+    se -> quantum_remain = 1;
+    se -> inherited = MINITHREAD_LEVELS;
+    se -> weight = SCHED_WEIGHT_DEFAULT;
+}
+
+/* Whether se runs ahead of others because it inherited a level */
+static int sched_boosted(sched_entity_t *se) {
+    return se -> inherited < MINITHREAD_LEVELS;
+}
+
+/*
+ * mlfq: the ready list has a queue per level. Which level is served
+ * depends on how far the CPU is into its cycle of quanta, in which each
+ * level gets its share.
+ */
+typedef struct mlfq {
+    multilevel_queue_t *levels;
+    int quantum;                // remaining quantum of the current cycle
+    uint64_t clock;             // time the CPU ran, in nanoseconds
+    uint64_t boosted_at;        // clock at the last boost
+} mlfq_t;
+
+static mlfq_params_t mlfq_params = {
+    MINITHREAD_LEVELS, {1, 2, 4, 8}, {80, 40, 24, 16}, SECOND
+};
+static int mlfq_cycle = 160;                // quanta in one cycle
+static int mlfq_ends[MINITHREAD_LEVELS] = {80, 120, 144, 160};
+
+static void* mlfq_new() {
+    mlfq_t *rq = (mlfq_t *) malloc(sizeof(mlfq_t));
+    if (rq == NULL)
+        return NULL;
+    rq -> levels = multilevel_queue_new_intrusive(MINITHREAD_LEVELS,
+                                                  offsetof(sched_entity_t, link));
+    if (rq -> levels == NULL) {
+        free(rq);
+        return NULL;
+    }
+    rq -> quantum = mlfq_cycle;
+    rq -> clock = rq -> boosted_at = 0;
+    return rq;
+}
+
+/* Put se at the top level with a full quantum */
+static void mlfq_reset(sched_entity_t *se) {
+    se -> level = 0;
+    se -> quantum_remain = mlfq_params.quantum[0];
+    se -> queue_level = 0;
+}
+
+static void mlfq_init(sched_entity_t *se) {
+    sched_init(se);
+    mlfq_reset(se);
+}
+
+/* Threads made runnable start at level 0 */
+static void mlfq_wake(void *rq, sched_entity_t *se) {
+    se -> queue_level = 0;
+    se -> run_level = 0;
+}
+
+static void mlfq_enqueue(void *rq, sched_entity_t *se) {
+    int level = se -> queue_level;
+    if (se -> inherited < level)
+        level = se -> inherited;
+    multilevel_queue_enqueue(((mlfq_t *) rq) -> levels, level, se);
+    se -> run_level = level;
+}
+
+static int mlfq_remove(void *rq, sched_entity_t *se) {
+    return multilevel_queue_delete(((mlfq_t *) rq) -> levels,
+                                   se -> run_level, se);
+}
+
+static sched_entity_t* mlfq_pick_next(void *rq) {
+    mlfq_t *m = (mlfq_t *) rq;
+    sched_entity_t *se;
+    int level = 0, served = mlfq_cycle - m -> quantum;
+
+    while (level < mlfq_params.levels - 1 && served >= mlfq_ends[level])
+        level++;
+    if (multilevel_queue_dequeue(m -> levels, level, (void **) &se) == -1)
+        return NULL;
+    // If it stops without using a quantum it goes back where it was
+    se -> queue_level = se -> level;
+    return se;
+}
+
+/* Move every thread on the ready list and curr, which runs, to level 0 */
+static void mlfq_boost(mlfq_t *m, sched_entity_t *curr) {
+    sched_entity_t *se;
+    int level;
+
+    for (level = 1; level < MINITHREAD_LEVELS; level++) {
+        while ((se = queue_peek(multilevel_queue_getq(m -> levels, level)))
+               != NULL) {
+            multilevel_queue_delete(m -> levels, level, se);
+            mlfq_reset(se);
+            mlfq_enqueue(m, se);
+        }
+    }
+    mlfq_reset(curr);
+    m -> boosted_at = m -> clock;
+}
+
+static void mlfq_tick(void *rq, sched_entity_t *se, uint64_t ran, 
+                      int blocked) {
+    mlfq_t *m = (mlfq_t *) rq;
+    mlfq_params_t *params = &mlfq_params;
+
+    // Switch back to level 0 at the end of a cycle
+    if (--m -> quantum <= 0 || m -> quantum > mlfq_cycle)
+        m -> quantum = mlfq_cycle;
+    m -> clock += ran;
+    if (params -> boost_interval != 0 && 
+        m -> clock - m -> boosted_at >= params -> boost_interval)
+        mlfq_boost(m, se);
+    if (se -> level >= params -> levels)
+        se -> level = params -> levels - 1;
+
+    if (blocked) {
+        // It blocked before using up its quantum, so it moves up a level
+        if (se -> level > 0) {
+            se -> level--;
+            se -> quantum_remain = params -> quantum[se -> level];
+        }
+    } else if (--se -> quantum_remain <= 0) {
+        // The last level will just enqueue at the end of the queue
+        if (se -> level < params -> levels - 1)
+            se -> level++;
+        se -> quantum_remain = params -> quantum[se -> level];
+    }
+    se -> queue_level = se -> level;
+}
+
+int sched_mlfq_tune(mlfq_params_t *params) {
+    interrupt_level_t old_level;
+    int level, end = 0;
+
+    if (params -> levels < 1 || params -> levels > MINITHREAD_LEVELS)
+        return -1;
+    for (level = 0; level < params -> levels; level++) {
+        if (params -> quantum[level] < 1 || params -> share[level] < 1)
+            return -1;
+    }
+    old_level = set_interrupt_level(DISABLED);
+    mlfq_params = *params;
+    for (level = 0; level < MINITHREAD_LEVELS; level++) {
+        if (level < params -> levels)
+            end += params -> share[level];
+        mlfq_ends[level] = end;
+    }
+    mlfq_cycle = end;
+    set_interrupt_level(old_level);
+    return 0;
+}
+
+void sched_mlfq_params(mlfq_params_t *params) {
+    *params = mlfq_params;
+}
+
+sched_ops_t sched_mlfq = {
+    "mlfq", mlfq_new, mlfq_init, mlfq_wake, mlfq_enqueue, mlfq_remove,
+    mlfq_pick_next, mlfq_tick
+};
+
+/* rr: one queue, boosted threads go to the front */
+static void* rr_new() {
+    return queue_new_intrusive(offsetof(sched_entity_t, link));
+}
+
+static void rr_wake(void *rq, sched_entity_t *se) {
+}
+
+static void rr_enqueue(void *rq, sched_entity_t *se) {
+    if (sched_boosted(se))
+        queue_prepend((queue_t *) rq, se);
+    else
+        queue_append((queue_t *) rq, se);
+}
+
+static int rr_remove(void *rq, sched_entity_t *se) {
+    return queue_delete((queue_t *) rq, se);
+}
+
+static sched_entity_t* rr_pick_next(void *rq) {
+    sched_entity_t *se;
+    if (queue_dequeue((queue_t *) rq, (void **) &se) == -1)
+        return NULL;
+    return se;
+}
+
+static void rr_tick(void *rq, sched_entity_t *se, uint64_t ran,
+                    int blocked) {
+}
+
+sched_ops_t sched_rr = {
+    "rr", rr_new, sched_init, rr_wake, rr_enqueue, rr_remove,
+    rr_pick_next, rr_tick
+};
+
+/*
+ * stride and cfs keep the ready list in a treap ordered by key, with ties
+ * broken by address: a binary search tree that is also a heap on random
+ * priorities, so it stays balanced in expectation without rebalancing.
+ */
+typedef struct tree {
+    sched_entity_t *root;
+    uint64_t min_key;           // key of the last thread picked
+    unsigned int seed;
+} tree_t;
+
+static int tree_less(sched_entity_t *a, sched_entity_t *b) {
+    return a -> key < b -> key || (a -> key == b -> key && a < b);
+}
+
+static sched_entity_t* tree_insert(sched_entity_t *root, sched_entity_t *se) {
+    sched_entity_t *child;
+
+    if (root == NULL)
+        return se;
+    if (tree_less(se, root)) {
+        child = root -> left = tree_insert(root -> left, se);
+        if (child -> priority < root -> priority) {
+            root -> left = child -> right;
+            child -> right = root;
+            return child;
+        }
+    } else {
+        child = root -> right = tree_insert(root -> right, se);
+        if (child -> priority < root -> priority) {
+            root -> right = child -> left;
+            child -> left = root;
+            return child;
+        }
+    }
+    return root;
+}
+
+/* Join two treaps where all of a is ordered before all of b */
+static sched_entity_t* tree_join(sched_entity_t *a, sched_entity_t *b) {
+    if (a == NULL)
+        return b;
+    if (b == NULL)
+        return a;
+    if (a -> priority < b -> priority) {
+        a -> right = tree_join(a -> right, b);
+        return a;
+    }
+    b -> left = tree_join(a, b -> left);
+    return b;
+}
+
+/* Remove se from the treap at *root. Return 0, or -1 if it is not there */
+static int tree_delete(sched_entity_t **root, sched_entity_t *se) {
+    while (*root != NULL && *root != se)
+        root = tree_less(se, *root) ? &((*root) -> left) : &((*root) -> right);
+    if (*root == NULL)
+        return -1;
+    *root = tree_join(se -> left, se -> right);
+    se -> left = se -> right = NULL;
+    return 0;
+}
+
+static void* tree_new() {
+    tree_t *rq = (tree_t *) malloc(sizeof(tree_t));
+    if (rq == NULL)
+        return NULL;
+    rq -> root = NULL;
+    rq -> min_key = 0;
+    rq -> seed = 2463534242U;
+    return rq;
+}
+
+static void tree_enqueue(void *rq, sched_entity_t *se) {
+    tree_t *tree = (tree_t *) rq;
+
+    // A thread lending its level to us waits, so we go first
+    if (sched_boosted(se) && se -> key > tree -> min_key)
+        se -> key = tree -> min_key;
+    // xorshift
+    tree -> seed ^= tree -> seed << 13;
+    tree -> seed ^= tree -> seed >> 17;
+    tree -> seed ^= tree -> seed << 5;
+    se -> priority = tree -> seed;
+    se -> left = se -> right = NULL;
+    tree -> root = tree_insert(tree -> root, se);
+}
+
+static int tree_remove(void *rq, sched_entity_t *se) {
+    return tree_delete(&(((tree_t *) rq) -> root), se);
+}
+
+static sched_entity_t* tree_pick_next(void *rq) {
+    tree_t *tree = (tree_t *) rq;
+    sched_entity_t *se = tree -> root;
+
+    if (se == NULL)
+        return NULL;
+    while (se -> left != NULL)
+        se = se -> left;
+    tree_delete(&(tree -> root), se);
+    if (se -> key > tree -> min_key)
+        tree -> min_key = se -> key;
+    return se;
+}
+
+/* A thread that blocked catches up with the others */
+static void stride_wake(void *rq, sched_entity_t *se) {
+    tree_t *tree = (tree_t *) rq;
+    if (se -> key < tree -> min_key)
+        se -> key = tree -> min_key;
+}
+
+static void stride_tick(void *rq, sched_entity_t *se, uint64_t ran,
+                        int blocked) {
+    se -> key += STRIDE_ONE / se -> weight;
+}
+
+sched_ops_t sched_stride = {
+    "stride", tree_new, sched_init, stride_wake, tree_enqueue, tree_remove,
+    tree_pick_next, stride_tick
+};
+
+/* A thread that slept is put a little ahead of the others, but no more */
+static void cfs_wake(void *rq, sched_entity_t *se) {
+    tree_t *tree = (tree_t *) rq;
+    if (se -> key + CFS_SLEEPER_BONUS < tree -> min_key)
+        se -> key = tree -> min_key - CFS_SLEEPER_BONUS;
+}
+
+static void cfs_tick(void *rq, sched_entity_t *se, uint64_t ran,
+                     int blocked) {
+    se -> key += ran * SCHED_WEIGHT_DEFAULT / se -> weight;
+}
+
+sched_ops_t sched_cfs = {
+    "cfs", tree_new, sched_init, cfs_wake, tree_enqueue, tree_remove,
+    tree_pick_next, cfs_tick
+};
+
+/* edf: a list sorted by deadline, equal deadlines in the order queued */
+static int edf_later(void *a, void *b) {
+    return ((sched_entity_t *) a) -> deadline > 
+        ((sched_entity_t *) b) -> deadline ? 1 : -1;
+}
+
+static void edf_enqueue(void *rq, sched_entity_t *se) {
+    queue_sorted_insert((queue_t *) rq, se, edf_later);
+}
+
+sched_ops_t sched_edf = {
+    "edf", rr_new, sched_init, rr_wake, edf_enqueue, rr_remove,
+    rr_pick_next, rr_tick
+};
+
+sched_ops_t* sched_lookup(char *name) {
+    sched_ops_t *all[] = {&sched_mlfq, &sched_rr, &sched_stride, &sched_cfs};
+    int i;
+
+    for (i = 0; i < sizeof(all) / sizeof(all[0]); i++) {
+        if (strcmp(all[i] -> name, name) == 0)
+            return all[i];
+    }
+    return NULL;
+}
@@ -0,0 +1,114 @@
+/*
+ * Scheduler policies. The ready list of every thread group on every CPU is
+ * owned by a policy, which decides what runs next in that group; the rest
+ * of minithread.c picks the group, hands the policy threads and asks for
+ * one back. Choose a policy with minithread_set_scheduler before
+ * minithread_system_initialize.
+ */
+#ifndef __SCHEDULER_H__
+#define __SCHEDULER_H__
+
+#include "queue.h"
+#include "machineprimitives.h"
+#include "minithread.h"
+
+/* Share of a thread that was not given a weight (see minithread_set_weight) */
+#define SCHED_WEIGHT_DEFAULT 1024
+
+/*
+ * Scheduling state embedded in every thread. The fields are shared by the
+ * policies; each policy uses the ones it needs.
+ */
+typedef struct sched_entity {
+    node_t link;                // link in a ready list
+    struct sched_entity *left;  // children in a ready tree
+    struct sched_entity *right;
+    unsigned int priority;      // heap order of the ready tree
+    int level;                  // MLFQ level the thread sank to
+    int quantum_remain;         // quanta left at that level
+    int queue_level;            // level it goes back on the ready list at
+    int run_level;              // level queued at, or last picked from
+    int inherited;              // level lent by waiters, see minithread.h
+    int weight;                 // share of the CPU under stride and cfs
+    uint64_t key;               // virtual runtime or pass, tree order
+    uint64_t deadline;          // end of the current period under edf
+} sched_entity_t;
+
+/*
+ * Policy operations. rq is the ready list of one group on one CPU, made by
+ * new. All of them run with interrupts disabled.
+ *
+ * wake:      se became runnable after blocking, or is new. It is about to
+ *            be queued with enqueue, or run at once by minithread_handoff.
+ * enqueue:   put se on rq: after wake, when it stops running without
+ *            blocking, or when it moves between ready lists.
+ * remove:    take se off rq. Return 0, or -1 if it was not there.
+ * pick_next: take the thread to run next off rq. Return NULL if empty.
+ * tick:      charge se for a turn on the CPU that lasted ran nanoseconds
+ *            and ended with se blocking if blocked is set. Called on every
+ *            reschedule, before pick_next.
+ *
+ * Policies that have no levels keep run_level at 0. A thread that inherited
+ * a level (inherited < MINITHREAD_LEVELS) should run ahead of those that
+ * did not.
+ */
+typedef struct sched_ops {
+    char *name;
+    void* (*new)();
+    void (*init)(sched_entity_t *se);
+    void (*wake)(void *rq, sched_entity_t *se);
+    void (*enqueue)(void *rq, sched_entity_t *se);
+    int (*remove)(void *rq, sched_entity_t *se);
+    sched_entity_t* (*pick_next)(void *rq);
+    void (*tick)(void *rq, sched_entity_t *se, uint64_t ran, int blocked);
+} sched_ops_t;
+
+/*
+ * mlfq:    multilevel feedback queue, the default. Threads sink a level each
+ *          time they use up the quantum of their level and rise one each
+ *          time they block, and all runnable threads go back to level 0
+ *          every boost interval. Each level gets its share of a cycle of
+ *          quanta. See mlfq_params_t for the defaults.
+ * rr:      a single first-in first-out ready list.
+ * stride:  each turn advances a thread's pass by a stride inversely
+ *          proportional to its weight; the lowest pass runs next.
+ * cfs:     like the Linux CFS, a thread's virtual runtime grows by the time
+ *          it ran divided by its weight; the lowest virtual runtime runs
+ *          next. Threads that slept get at most a short head start.
+ */
+extern sched_ops_t sched_mlfq;
+extern sched_ops_t sched_rr;
+extern sched_ops_t sched_stride;
+extern sched_ops_t sched_cfs;
+
+/*
+ * edf: the real-time class, which minithread.c runs ahead of the policy
+ * chosen (see minithread_set_deadline). The earliest deadline runs next.
+ */
+extern sched_ops_t sched_edf;
+
+/*
+ * Tunables of sched_mlfq. A quantum is one reschedule: a clock tick, a
+ * yield or a block. By default there are 4 levels with quanta of 1, 2, 4
+ * and 8, which get 80, 40, 24 and 16 quanta of each cycle, and threads are
+ * boosted every second of CPU time.
+ */
+typedef struct mlfq_params {
+    int levels;                         // 1 to MINITHREAD_LEVELS
+    int quantum[MINITHREAD_LEVELS];     // quanta at a level before sinking
+    int share[MINITHREAD_LEVELS];       // quanta of the cycle for a level
+    uint64_t boost_interval;            // in nanoseconds, 0 for never
+} mlfq_params_t;
+
+/*
+ * Set the tunables of sched_mlfq, which take effect at once. Threads below
+ * the last level in use move up to it. Returns 0, or -1 if params are
+ * invalid. sched_mlfq_params gets the current ones.
+ */
+int sched_mlfq_tune(mlfq_params_t *params);
+void sched_mlfq_params(mlfq_params_t *params);
+
+/* Return the policy called name, or NULL if there is none */
+sched_ops_t* sched_lookup(char *name);
+
+#endif /*__SCHEDULER_H__*/
@@ -6,11 +6,11 @@
 #include "queue.h"
 #include "interrupts.h"
 #include "minithread.h"
-
-extern minithread_t *curr_thread;
+#include "trace.h"
 
 struct semaphore {
     int cnt;
+    tas_lock_t lock;            // guards w_queue
     queue_t *w_queue;
 };
 
@@ -20,12 +20,13 @@ semaphore_t* semaphore_create() {
         fprintf(stderr, "Failed to allocate\n");
         return NULL;
     }
-    s -> w_queue = queue_new();
+    s -> w_queue = minithread_queue_new();
     if (s -> w_queue == NULL) {
         free(s);
         fprintf(stderr, "Failed to allocate\n");
         return NULL;
     }
+    s -> lock = 0;
     return s;
 }
 
@@ -42,35 +43,509 @@ void semaphore_initialize(semaphore_t *sem, int cnt) {
     sem -> cnt = cnt;
 }
 
+/*
+ * The count goes negative while threads wait: -cnt threads are then in
+ * w_queue. Taking a unit while cnt > 0, or returning one while cnt >= 0,
+ * is a compare_and_swap on cnt without disabling interrupts. Only the
+ * paths that block or wake a thread take the lock of the semaphore, and
+ * they still update cnt with compare_and_swap since the fast paths do not.
+ * They hold off interrupts on this CPU only, not taking the kernel lock,
+ * so semaphores on different CPUs do not contend. A waiter drops the lock
+ * before it stops, and may be woken before it is off the CPU, which
+ * minithread_start and minithread_stop allow for.
+ */
+
+/* Add delta to the count of sem and return the old count */
+static int semaphore_add(semaphore_t *sem, int delta) {
+    int cnt;
+
+    do {
+        cnt = sem -> cnt;
+    } while (compare_and_swap(&(sem -> cnt), cnt, cnt + delta) != cnt);
+    return cnt;
+}
+
+/* Return a unit to sem if nobody waits for it. Return 1 on success */
+static int semaphore_V_fast(semaphore_t *sem) {
+    int cnt;
+
+    while ((cnt = sem -> cnt) >= 0) {
+        if (compare_and_swap(&(sem -> cnt), cnt, cnt + 1) == cnt) {
+            TRACE(TRACE_SEM_V, sem, 0);
+            return 1;
+        }
+    }
+    return 0;
+}
+
 void semaphore_P(semaphore_t *sem) {
+    int cnt;
+
     if (sem == NULL) 
         return;
 
-    interrupt_level_t old_level = set_interrupt_level(DISABLED);
-    if (sem -> cnt > 0) {
-        sem -> cnt--;
+    while ((cnt = sem -> cnt) > 0) {
+        if (compare_and_swap(&(sem -> cnt), cnt, cnt - 1) == cnt) {
+            TRACE(TRACE_SEM_P, sem, 0);
+            return;
+        }
+    }
+
+    interrupt_level_t old_level = set_interrupt_level_local(DISABLED);
+    spinlock_acquire(&(sem -> lock));
+    if (semaphore_add(sem, -1) > 0) {
+        spinlock_release(&(sem -> lock));
+        TRACE(TRACE_SEM_P, sem, 0);
     } else {
-        queue_append(sem -> w_queue, curr_thread);
+        TRACE(TRACE_SEM_P, sem, 1);
+        queue_append(sem -> w_queue, minithread_self());
+        spinlock_release(&(sem -> lock));
         minithread_stop();
     }   
-    set_interrupt_level(old_level);
+    set_interrupt_level_local(old_level);
 }
 
 void semaphore_V(semaphore_t *sem) {
-    if (sem == NULL) 
+    minithread_t *next_thread;
+
+    if (sem == NULL || semaphore_V_fast(sem)) 
         return;
     
+    interrupt_level_t old_level = set_interrupt_level_local(DISABLED);
+    spinlock_acquire(&(sem -> lock));
+    if (semaphore_add(sem, 1) >= 0 ||
+        queue_dequeue(sem -> w_queue, (void **) &next_thread) != 0)
+        next_thread = NULL;
+    spinlock_release(&(sem -> lock));
+    TRACE(TRACE_SEM_V, sem, next_thread != NULL);
+    minithread_start(next_thread);
+    set_interrupt_level_local(old_level);
+}
+
+void semaphore_V_handoff(semaphore_t *sem) {
+    minithread_t *next_thread;
+
+    if (sem == NULL || semaphore_V_fast(sem)) 
+        return;
+
+    interrupt_level_t old_level = set_interrupt_level_local(DISABLED);
+    spinlock_acquire(&(sem -> lock));
+    if (semaphore_add(sem, 1) >= 0 ||
+        queue_dequeue(sem -> w_queue, (void **) &next_thread) != 0)
+        next_thread = NULL;
+    spinlock_release(&(sem -> lock));
+    TRACE(TRACE_SEM_V, sem, next_thread != NULL);
+    // Interrupt handlers and critical sections must not switch
+    if (next_thread != NULL && old_level == ENABLED)
+        minithread_handoff(next_thread);
+    else
+        minithread_start(next_thread);
+    set_interrupt_level_local(old_level);
+}
+
+/*
+ * Mutexes. state is 0 when free, 1 when held and 2 when held with threads
+ * in w_queue. Locking a free mutex and unlocking one nobody waits for are a
+ * compare_and_swap each. Otherwise the kernel lock is taken, and unlocking
+ * hands the mutex straight to the first waiter.
+ *
+ * A thread blocking on a mutex lends its scheduling level to the owner, and
+ * on down the chain if the owner itself waits for a mutex, so a low
+ * priority holder cannot keep a high priority waiter off the CPU. The owner
+ * keeps the best level of the waiters on all mutexes it holds until it
+ * unlocks them.
+ */
+struct mutex {
+    int state;
+    minithread_t *owner;
+    queue_t *w_queue;
+    mutex_t *next_held;         // next mutex held by the owner
+};
+
+/* Add m to the mutexes t holds */
+static void mutex_hold(mutex_t *m, minithread_t *t) {
+    mutex_t **held = minithread_mutexes_held(t);
+
+    m -> owner = t;
+    m -> next_held = *held;
+    *held = m;
+}
+
+/* Remove m from the mutexes t holds */
+static void mutex_release(mutex_t *m, minithread_t *t) {
+    mutex_t **held = minithread_mutexes_held(t);
+
+    while (*held != NULL && *held != m)
+        held = &((*held) -> next_held);
+    if (*held == m)
+        *held = m -> next_held;
+    m -> owner = NULL;
+}
+
+/* Lend level to the owner of m and on down the chain. Needs the kernel lock */
+static void mutex_boost(mutex_t *m, int level) {
+    minithread_t *owner;
+
+    while (m != NULL && (owner = m -> owner) != NULL && 
+           minithread_level(owner) > level) {
+        minithread_inherit_level(owner, level);
+        m = *minithread_mutex_waiting(owner);
+    }
+}
+
+static void mutex_waiter_level(void *t, void *level) {
+    if (minithread_level((minithread_t *) t) < *((int *) level))
+        *((int *) level) = minithread_level((minithread_t *) t);
+}
+
+/* Best level of the threads waiting for m. Needs the kernel lock */
+static int mutex_waiters_level(mutex_t *m) {
+    int level = MINITHREAD_LEVELS;
+
+    queue_iterate(m -> w_queue, mutex_waiter_level, &level);
+    return level;
+}
+
+/* 
+ * Recompute what t inherits from the waiters of the mutexes it still holds.
+ * Needs the kernel lock.
+ */
+static void mutex_unboost(minithread_t *t) {
+    mutex_t *m;
+    int level = MINITHREAD_LEVELS, l;
+
+    for (m = *minithread_mutexes_held(t); m != NULL; m = m -> next_held) {
+        if ((l = mutex_waiters_level(m)) < level)
+            level = l;
+    }
+    minithread_inherit_level(t, level);
+}
+
+mutex_t* mutex_create() {
+    mutex_t *m;
+    if ((m = (mutex_t *) malloc(sizeof(mutex_t))) == NULL) {
+        fprintf(stderr, "Failed to allocate\n");
+        return NULL;
+    }
+    if ((m -> w_queue = minithread_queue_new()) == NULL) {
+        free(m);
+        fprintf(stderr, "Failed to allocate\n");
+        return NULL;
+    }
+    m -> state = 0;
+    m -> owner = NULL;
+    m -> next_held = NULL;
+    return m;
+}
+
+void mutex_destroy(mutex_t *m) {
+    if (m == NULL) 
+        return;
+    queue_free(m -> w_queue);
+    free(m);
+}
+
+void mutex_lock(mutex_t *m) {
+    if (m == NULL) 
+        return;
+
+    if (compare_and_swap(&(m -> state), 0, 1) == 0) {
+        mutex_hold(m, minithread_self());
+        return;
+    }
+
+    interrupt_level_t old_level = set_interrupt_level(DISABLED);
+    minithread_t *self = minithread_self();
+    // Only the fast path changes state without the kernel lock, from 0 or to 0
+    if (swap(&(m -> state), 2) == 0) {
+        // Released meanwhile, but we may have set 2 with nobody waiting
+        if (queue_length(m -> w_queue) == 0)
+            m -> state = 1;
+        mutex_hold(m, self);
+    } else {
+        queue_append(m -> w_queue, self);
+        *minithread_mutex_waiting(self) = m;
+        mutex_boost(m, minithread_level(self));
+        // mutex_unlock makes us the owner before waking us
+        minithread_stop();
+    }
+    set_interrupt_level(old_level);
+}
+
+int mutex_trylock(mutex_t *m) {
+    if (m == NULL || compare_and_swap(&(m -> state), 0, 1) != 0) 
+        return -1;
+    mutex_hold(m, minithread_self());
+    return 0;
+}
+
+int mutex_unlock(mutex_t *m) {
+    minithread_t *next_thread;
+
+    minithread_t *self = minithread_self();
+
+    if (m == NULL || m -> owner != self) 
+        return -1;
+
+    mutex_release(m, self);
+    if (compare_and_swap(&(m -> state), 1, 0) == 1) 
+        return 0;
+
     interrupt_level_t old_level = set_interrupt_level(DISABLED);
-    if (queue_length(sem -> w_queue) == 0) { 
-        sem -> cnt++;
+    if (queue_dequeue(m -> w_queue, (void **) &next_thread) == 0) {
+        *minithread_mutex_waiting(next_thread) = NULL;
+        mutex_hold(m, next_thread);
+        if (queue_length(m -> w_queue) > 0) {
+            m -> state = 2;
+            mutex_boost(m, mutex_waiters_level(m));
+        } else {
+            m -> state = 1;
+        }
+        minithread_start(next_thread);
     } else {
-        minithread_t *next_thread;
-        // no thread to switch to
-        if (queue_dequeue(sem -> w_queue, (void **) &next_thread) == -1) {
-            fprintf(stderr, "Failed to fetch next job from the ready list\n");
-            return; 
+        m -> state = 0;
+    }
+    // Give back what the waiters of m lent us
+    mutex_unboost(self);
+    set_interrupt_level(old_level);
+    return 0;
+}
+
+minithread_t* mutex_owner(mutex_t *m) {
+    return m == NULL ? NULL : m -> owner;
+}
+
+/*
+ * Condition variables. Waiting and waking always take the kernel lock, which
+ * also makes releasing the mutex and going to sleep one step.
+ */
+struct cond {
+    queue_t *w_queue;
+};
+
+cond_t* cond_create() {
+    cond_t *c;
+    if ((c = (cond_t *) malloc(sizeof(cond_t))) == NULL) {
+        fprintf(stderr, "Failed to allocate\n");
+        return NULL;
+    }
+    if ((c -> w_queue = minithread_queue_new()) == NULL) {
+        free(c);
+        fprintf(stderr, "Failed to allocate\n");
+        return NULL;
+    }
+    return c;
+}
+
+void cond_destroy(cond_t *c) {
+    if (c == NULL) 
+        return;
+    queue_free(c -> w_queue);
+    free(c);
+}
+
+int cond_wait(cond_t *c, mutex_t *m) {
+    if (c == NULL || m == NULL || m -> owner != minithread_self()) 
+        return -1;
+
+    interrupt_level_t old_level = set_interrupt_level(DISABLED);
+    queue_append(c -> w_queue, minithread_self());
+    mutex_unlock(m);
+    minithread_stop();
+    set_interrupt_level(old_level);
+    mutex_lock(m);
+    return 0;
+}
+
+void cond_signal(cond_t *c) {
+    minithread_t *next_thread;
+
+    if (c == NULL) 
+        return;
+
+    interrupt_level_t old_level = set_interrupt_level(DISABLED);
+    if (queue_dequeue(c -> w_queue, (void **) &next_thread) == 0)
+        minithread_start(next_thread);
+    set_interrupt_level(old_level);
+}
+
+void cond_broadcast(cond_t *c) {
+    minithread_t *next_thread;
+
+    if (c == NULL) 
+        return;
+
+    interrupt_level_t old_level = set_interrupt_level(DISABLED);
+    while (queue_dequeue(c -> w_queue, (void **) &next_thread) == 0)
+        minithread_start(next_thread);
+    set_interrupt_level(old_level);
+}
+
+/*
+ * Reader-writer locks. state holds the number of readers, or RW_WRITER
+ * while a writer holds the lock, plus RW_WAITING while any thread waits.
+ * The fast paths are compare_and_swap loops that give up once RW_WAITING is
+ * set, so while it is set only the slow paths, which hold the kernel lock,
+ * change state.
+ *
+ * New readers queue behind waiting writers, so writers do not starve. When a
+ * writer unlocks, every waiting reader is let in as one batch; when the last
+ * reader of a batch unlocks, the next writer gets the lock.
+ */
+#define RW_WRITER  (1 << 29)
+#define RW_WAITING (1 << 30)
+
+struct rwlock {
+    int state;
+    queue_t *readers;
+    queue_t *writers;
+};
+
+rwlock_t* rwlock_create() {
+    rwlock_t *l;
+    if ((l = (rwlock_t *) malloc(sizeof(rwlock_t))) == NULL) {
+        fprintf(stderr, "Failed to allocate\n");
+        return NULL;
+    }
+    l -> readers = minithread_queue_new();
+    l -> writers = minithread_queue_new();
+    if (l -> readers == NULL || l -> writers == NULL) {
+        queue_free(l -> readers);
+        queue_free(l -> writers);
+        free(l);
+        fprintf(stderr, "Failed to allocate\n");
+        return NULL;
+    }
+    l -> state = 0;
+    return l;
+}
+
+void rwlock_destroy(rwlock_t *l) {
+    if (l == NULL) 
+        return;
+    queue_free(l -> readers);
+    queue_free(l -> writers);
+    free(l);
+}
+
+/* RW_WAITING if anything waits on l, else 0. Needs the kernel lock */
+static int rwlock_waiting(rwlock_t *l) {
+    return queue_length(l -> readers) + queue_length(l -> writers) > 0 ? 
+        RW_WAITING : 0;
+}
+
+/* Let every waiting reader in. Needs the kernel lock */
+static void rwlock_admit_readers(rwlock_t *l) {
+    minithread_t *next_thread;
+    int readers = 0;
+
+    while (queue_dequeue(l -> readers, (void **) &next_thread) == 0) {
+        readers++;
+        minithread_start(next_thread);
+    }
+    l -> state = readers | rwlock_waiting(l);
+}
+
+/* Queue the caller on q and sleep until it is given the lock */
+static void rwlock_wait(rwlock_t *l, queue_t *q) {
+    int state;
+
+    do {
+        state = l -> state;
+    } while (compare_and_swap(&(l -> state), state, state | RW_WAITING) != 
+             state);
+    queue_append(q, minithread_self());
+    minithread_stop();
+}
+
+void rwlock_read_lock(rwlock_t *l) {
+    int state;
+
+    if (l == NULL) 
+        return;
+
+    while (((state = l -> state) & (RW_WRITER | RW_WAITING)) == 0) {
+        if (compare_and_swap(&(l -> state), state, state + 1) == state)
+            return;
+    }
+
+    interrupt_level_t old_level = set_interrupt_level(DISABLED);
+    for (;;) {
+        state = l -> state;
+        if ((state & RW_WRITER) || queue_length(l -> writers) > 0) {
+            rwlock_wait(l, l -> readers);
+            break;
+        }
+        if (compare_and_swap(&(l -> state), state, state + 1) == state)
+            break;
+    }
+    set_interrupt_level(old_level);
+}
+
+void rwlock_read_unlock(rwlock_t *l) {
+    minithread_t *next_thread;
+    int state;
+
+    if (l == NULL) 
+        return;
+
+    while (((state = l -> state) & RW_WAITING) == 0) {
+        if (compare_and_swap(&(l -> state), state, state - 1) == state)
+            return;
+    }
+
+    interrupt_level_t old_level = set_interrupt_level(DISABLED);
+    l -> state--;
+    if ((l -> state & ~RW_WAITING) == 0) {
+        // The last reader out lets the next writer in
+        if (queue_dequeue(l -> writers, (void **) &next_thread) == 0) {
+            l -> state = RW_WRITER | rwlock_waiting(l);
+            minithread_start(next_thread);
+        } else {
+            rwlock_admit_readers(l);
         }
+    }
+    set_interrupt_level(old_level);
+}
+
+void rwlock_write_lock(rwlock_t *l) {
+    int state;
+
+    if (l == NULL) 
+        return;
+
+    if (compare_and_swap(&(l -> state), 0, RW_WRITER) == 0)
+        return;
+
+    interrupt_level_t old_level = set_interrupt_level(DISABLED);
+    for (;;) {
+        state = l -> state;
+        if ((state & ~RW_WAITING) != 0) {
+            rwlock_wait(l, l -> writers);
+            break;
+        }
+        if (compare_and_swap(&(l -> state), state, state | RW_WRITER) == state)
+            break;
+    }
+    set_interrupt_level(old_level);
+}
+
+void rwlock_write_unlock(rwlock_t *l) {
+    minithread_t *next_thread;
+
+    if (l == NULL || 
+        compare_and_swap(&(l -> state), RW_WRITER, 0) == RW_WRITER) 
+        return;
+
+    interrupt_level_t old_level = set_interrupt_level(DISABLED);
+    if (queue_length(l -> readers) > 0) {
+        // Let the whole batch of waiting readers in
+        rwlock_admit_readers(l);
+    } else if (queue_dequeue(l -> writers, (void **) &next_thread) == 0) {
+        l -> state = RW_WRITER | rwlock_waiting(l);
         minithread_start(next_thread);
+    } else {
+        l -> state = 0;
     }
     set_interrupt_level(old_level);
 }
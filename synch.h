@@ -5,7 +5,12 @@
 #ifndef __SYNCH_H__
 #define __SYNCH_H__
 
+#include "minithread.h"
+
 typedef struct semaphore semaphore_t;
+typedef struct mutex mutex_t;
+typedef struct cond cond_t;
+typedef struct rwlock rwlock_t;
 
 /*
  * Semaphores.
@@ -47,4 +52,142 @@ void semaphore_P(semaphore_t *sem);
  */
 void semaphore_V(semaphore_t *sem);
 
+/*
+ * semaphore_V_handoff(semaphore_t sem)
+ * 
+ * V on the semaphore, but if a thread is waiting, switch to it at once
+ * instead of queueing it behind every other ready thread (see
+ * minithread_handoff). Pipelines that pass one item at a time between
+ * threads get much lower latency this way. With interrupts disabled it is
+ * a plain semaphore_V.
+ */
+void semaphore_V_handoff(semaphore_t *sem);
+
+/*
+ * Mutexes. Unlike a semaphore initialized to 1, a mutex knows its owner and
+ * only the owner may unlock it. Locking a free mutex and unlocking one that
+ * nobody waits for do not disable interrupts. A waiting thread is handed the
+ * mutex directly when it is unlocked, in the order the threads blocked.
+ */
+
+/*
+ * mutex_t* mutex_create()
+ * 
+ * Allocate a new, unlocked mutex.
+ */
+mutex_t* mutex_create();
+
+/*
+ * mutex_destroy(mutex_t *m)
+ * 
+ * Deallocate a mutex. Nobody may hold it or wait for it.
+ */
+void mutex_destroy(mutex_t *m);
+
+/*
+ * mutex_lock(mutex_t *m)
+ * 
+ * Lock the mutex, blocking until it is free. Mutexes are not recursive.
+ */
+void mutex_lock(mutex_t *m);
+
+/*
+ * int mutex_trylock(mutex_t *m)
+ * 
+ * Lock the mutex if it is free and return 0, else return -1 at once.
+ */
+int mutex_trylock(mutex_t *m);
+
+/*
+ * int mutex_unlock(mutex_t *m)
+ * 
+ * Unlock the mutex. Returns 0, or -1 if the caller does not hold it.
+ */
+int mutex_unlock(mutex_t *m);
+
+/*
+ * minithread_t* mutex_owner(mutex_t *m)
+ * 
+ * Return the thread holding the mutex, or NULL if it is free.
+ */
+minithread_t* mutex_owner(mutex_t *m);
+
+/*
+ * Condition variables, used with a mutex.
+ */
+
+/*
+ * cond_t* cond_create()
+ * 
+ * Allocate a new condition variable.
+ */
+cond_t* cond_create();
+
+/*
+ * cond_destroy(cond_t *c)
+ * 
+ * Deallocate a condition variable. Nobody may wait on it.
+ */
+void cond_destroy(cond_t *c);
+
+/*
+ * int cond_wait(cond_t *c, mutex_t *m)
+ * 
+ * Unlock m and wait on c in one step, then lock m again before returning.
+ * The condition waited for may no longer hold by then, so check it in a
+ * loop. Returns 0, or -1 if the caller does not hold m.
+ */
+int cond_wait(cond_t *c, mutex_t *m);
+
+/*
+ * cond_signal(cond_t *c)
+ * 
+ * Wake the thread that has waited on c the longest, if any.
+ */
+void cond_signal(cond_t *c);
+
+/*
+ * cond_broadcast(cond_t *c)
+ * 
+ * Wake every thread waiting on c.
+ */
+void cond_broadcast(cond_t *c);
+
+/*
+ * Reader-writer locks. Any number of readers or one writer may hold the
+ * lock. Taking and releasing it without contention do not disable
+ * interrupts. Readers that arrive while a writer waits queue behind it, and
+ * all readers waiting when a writer unlocks are let in together.
+ */
+
+/*
+ * rwlock_t* rwlock_create()
+ * 
+ * Allocate a new, unlocked reader-writer lock.
+ */
+rwlock_t* rwlock_create();
+
+/*
+ * rwlock_destroy(rwlock_t *l)
+ * 
+ * Deallocate a reader-writer lock. Nobody may hold it or wait for it.
+ */
+void rwlock_destroy(rwlock_t *l);
+
+/*
+ * rwlock_read_lock(rwlock_t *l), rwlock_read_unlock(rwlock_t *l)
+ * 
+ * Take and release the lock for reading.
+ */
+void rwlock_read_lock(rwlock_t *l);
+void rwlock_read_unlock(rwlock_t *l);
+
+/*
+ * rwlock_write_lock(rwlock_t *l), rwlock_write_unlock(rwlock_t *l)
+ * 
+ * Take and release the lock for writing.
+ */
+void rwlock_write_lock(rwlock_t *l);
+void rwlock_write_unlock(rwlock_t *l);
+
 #endif /*__SYNCH_H__*/
@@ -0,0 +1,88 @@
+/* alarm_bench.c
+ *
+ * Alarm benchmark. Registers [alarms] alarms spread over the next hour,
+ * deregisters every other one, then steps the clock tick by tick until all
+ * the rest have fired. Prints the cost of each phase and exits.
+ *
+ * The clock is stepped by hand with interrupts disabled, so the benchmark
+ * takes seconds rather than an hour.
+ *
+ * USAGE: ./alarm_bench [alarms]
+ *
+ * where [alarms] is the number of alarms to register (default 1000000).
+ */
+
+#include "minithread.h"
+#include "interrupts.h"
+#include "alarm.h"
+#include "random.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#define HOUR (60 * 60 * 1000)
+
+int alarms = 1000000;
+int fired = 0;
+
+void count_alarm(void *arg) {
+    fired++;
+}
+
+double ns_per(uint64_t ms, int n) {
+    return n == 0 ? 0 : ms * 1000000.0 / n;
+}
+
+int bench(int* arg) {
+    alarm_id *ids = (alarm_id *) malloc(alarms * sizeof(alarm_id));
+    long first_tick = ticks;
+    long end_tick = ticks + (long) HOUR * MILLISECOND / PERIOD + 1;
+    uint64_t start, elapsed;
+    int i, pending = 0;
+
+    if (ids == NULL) {
+        printf("out of memory\n");
+        exit(1);
+    }
+    // Keep the clock out of the way
+    set_interrupt_level(DISABLED);
+
+    sgenrand(4357);
+    start = currentTimeMillis();
+    for (i = 0; i < alarms; i++)
+        ids[i] = alarm_register((int) (genrand() * HOUR), count_alarm, NULL);
+    elapsed = currentTimeMillis() - start;
+    printf("register:   %d alarms in %lu ms, %.0f ns each\n", alarms,
+           (unsigned long) elapsed, ns_per(elapsed, alarms));
+
+    start = currentTimeMillis();
+    for (i = 0; i < alarms; i += 2)
+        alarm_deregister(ids[i]);
+    elapsed = currentTimeMillis() - start;
+    printf("deregister: %d alarms in %lu ms, %.0f ns each\n", (alarms + 1) / 2,
+           (unsigned long) elapsed, ns_per(elapsed, (alarms + 1) / 2));
+
+    start = currentTimeMillis();
+    while (ticks < end_tick) {
+        ticks++;
+        do_alarms();
+    }
+    elapsed = currentTimeMillis() - start;
+    printf("expire:     %d alarms over %ld ticks in %lu ms, %.0f ns per tick\n",
+           fired, end_tick - first_tick, (unsigned long) elapsed,
+           ns_per(elapsed, end_tick - first_tick));
+
+    for (i = 1; i < alarms; i += 2)
+        pending += !alarm_deregister(ids[i]);
+    if (fired != alarms / 2 || pending != 0)
+        printf("error: %d alarms fired, %d still pending\n", fired, pending);
+    exit(0);
+}
+
+int main(int argc, char *argv[]) {
+    if (argc > 1)
+        alarms = atoi(argv[1]);
+
+    minithread_system_initialize(bench, NULL);
+    return -1;
+}
@@ -6,6 +6,10 @@
  * synchronization implementations.
  *
  * Change MAXCOUNT to vary the number of items produced by the producer.
+ *
+ * USAGE: ./buffer [ncpus]
+ *
+ * where [ncpus] is the number of virtual CPUs to run on (default 1).
  */
 
 #include <stdio.h>
@@ -79,6 +83,8 @@ int main(int argc, char * argv[]) {
   full = semaphore_create();
   semaphore_initialize(full, BUFFER_SIZE);
 
+  if (argc > 1)
+    minithread_set_cpus(atoi(argv[1]));
   minithread_system_initialize(producer, &maxcount);
   return -1;
 }
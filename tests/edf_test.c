@@ -0,0 +1,153 @@
+/* edf_test.c
+ *
+ * Real-time test. Two periodic tasks compute for part of every period and
+ * sleep until the next one, while CPU hogs that never yield keep the CPU
+ * busy. The test runs once with the tasks as ordinary threads and once with
+ * them in the real-time class, and prints how many jobs of each task
+ * finished after the end of their period. Last, it checks that every CPU
+ * admits one thread that needs all of it, and no more, then exits.
+ *
+ * USAGE: ./edf_test [ms] [hogs] [cpus]
+ *
+ * where [ms] is how long each run lasts (default 1000), [hogs] is the
+ * number of CPU hogs (default 2) and [cpus] is the number of virtual CPUs
+ * (default 1).
+ */
+
+#include "minithread.h"
+#include "interrupts.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#define TASKS 2
+
+typedef struct task {
+    uint64_t period;
+    uint64_t work;
+    uint64_t budget;
+} task_t;
+
+task_t tasks[TASKS] = {
+    {5 * MILLISECOND, 1 * MILLISECOND, 2 * MILLISECOND},
+    {10 * MILLISECOND, 3 * MILLISECOND, 4 * MILLISECOND},
+};
+
+int duration = 1000;
+int hogs = 2;
+int ncpu = 1;
+int real_time;
+volatile int done;
+
+/*
+ * Compute for about ns nanoseconds. This counts cycles rather than reading
+ * the clock, because interrupts that arrive inside the C library are lost.
+ */
+double cycles_per_ns;
+
+void spin(uint64_t ns) {
+    uint64_t end = minithread_cycles() + (uint64_t) (ns * cycles_per_ns);
+    while (minithread_cycles() < end)
+        ;
+}
+
+int hog(int* arg) {
+    while (!done)
+        spin(MILLISECOND);
+    return 0;
+}
+
+int periodic(int* arg) {
+    task_t *task = &tasks[*arg];
+    minithread_stats_t stats;
+    uint64_t release = minithread_clock_now();
+    int jobs = 0, late = 0;
+
+    while (!done) {
+        spin(task -> work);
+        jobs++;
+        if (minithread_clock_now() > release + task -> period)
+            late++;
+        release += task -> period;
+        minithread_sleep_until(release);
+    }
+    printf("%-9s task %d: %5d jobs, %5d late", 
+           real_time ? "real-time" : "ordinary", *arg, jobs, late);
+    if (real_time) {
+        minithread_stats(minithread_self(), &stats);
+        printf(", %5lu deadline misses reported", 
+               (unsigned long) stats.deadline_misses);
+    }
+    printf("\n");
+    return 0;
+}
+
+void run() {
+    minithread_t **t = (minithread_t **) malloc((TASKS + hogs) * sizeof(*t));
+    int args[TASKS], i;
+
+    done = 0;
+    for (i = 0; i < TASKS; i++) {
+        args[i] = i;
+        t[i] = minithread_create_joinable(periodic, &args[i]);
+        if (real_time && minithread_set_deadline(t[i], tasks[i].period, 
+                                                 tasks[i].budget) == -1)
+            printf("task %d: admission failed\n", i);
+        minithread_start(t[i]);
+    }
+    for (i = 0; i < hogs; i++)
+        t[TASKS + i] = minithread_fork_joinable(hog, NULL);
+    minithread_sleep_for((uint64_t) duration * MILLISECOND);
+    done = 1;
+    for (i = 0; i < TASKS + hogs; i++)
+        minithread_join(t[i], NULL);
+    free(t);
+}
+
+/* Admit threads that need a whole CPU: one per CPU should fit */
+int admit() {
+    minithread_t **t = (minithread_t **) malloc((ncpu + 1) * sizeof(*t));
+    int i, admitted = 0;
+
+    // They are never started, so never freed either
+    for (i = 0; i <= ncpu; i++) {
+        t[i] = minithread_create(hog, NULL);
+        if (minithread_set_deadline(t[i], 10 * MILLISECOND, 
+                                    10 * MILLISECOND) == 0)
+            admitted++;
+    }
+    for (i = 0; i <= ncpu; i++)
+        minithread_set_deadline(t[i], 0, 0);
+    free(t);
+    printf("admission: %d threads that need a whole CPU admitted on %d "
+           "CPUs\n", admitted, ncpu);
+    return admitted != ncpu;
+}
+
+int test(int* arg) {
+    uint64_t start = minithread_clock_now(), cycles = minithread_cycles();
+
+    minithread_sleep_for(10 * MILLISECOND);
+    cycles_per_ns = (double) (minithread_cycles() - cycles) / 
+        (minithread_clock_now() - start);
+
+    real_time = 0;
+    run();
+    real_time = 1;
+    run();
+    exit(admit());
+}
+
+int main(int argc, char *argv[]) {
+    if (argc > 1)
+        duration = atoi(argv[1]);
+    if (argc > 2)
+        hogs = atoi(argv[2]);
+    if (argc > 3) {
+        ncpu = atoi(argv[3]);
+        minithread_set_cpus(ncpu);
+    }
+
+    minithread_system_initialize(test, NULL);
+    return -1;
+}
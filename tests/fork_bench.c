@@ -0,0 +1,56 @@
+/* fork_bench.c
+ *
+ * Thread fork/join rate benchmark. Forks short-lived threads one after
+ * another and joins each one, which returns at once. Prints the fork/join
+ * rate and exits.
+ *
+ * USAGE: ./fork_bench [threads] [cache]
+ *
+ * where [threads] is the number of threads to fork (default 100000) and
+ * [cache] is the number of stacks the stack cache keeps (default 64, 0
+ * disables the cache).
+ */
+
+#include "minithread.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+int threads = 100000;
+
+int child(int* arg) {
+    return 1;
+}
+
+int parent(int* arg) {
+    int i, ret, sum = 0;
+    uint64_t start, elapsed;
+
+    start = currentTimeMillis();
+    for (i = 0; i < threads; i++) {
+        if (minithread_join(minithread_fork_joinable(child, NULL), &ret) == -1) {
+            printf("join failed after %d threads\n", i);
+            exit(1);
+        }
+        sum += ret;
+    }
+    if (sum != threads)
+        printf("children returned %d, expected %d\n", sum, threads);
+    elapsed = currentTimeMillis() - start;
+    if (elapsed == 0)
+        elapsed = 1;
+
+    printf("%d threads in %lu ms, %.0f forks per second\n", threads,
+           (unsigned long) elapsed, threads * 1000.0 / elapsed);
+    exit(0);
+}
+
+int main(int argc, char *argv[]) {
+    if (argc > 1)
+        threads = atoi(argv[1]);
+    if (argc > 2)
+        minithread_set_stack_cache(atoi(argv[2]));
+
+    minithread_system_initialize(parent, NULL);
+    return -1;
+}
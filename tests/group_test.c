@@ -0,0 +1,155 @@
+/* group_test.c
+ *
+ * Thread group test. Two tenants, each in a group of its own, fork CPU-bound
+ * threads that compute in short bursts, yielding between them: one tenant
+ * forks a single thread, the other many. The groups should split the CPU
+ * by weight however many threads each has, first with equal weights, then
+ * with one twice the other. Last, a group with a quota of a fifth of the CPU
+ * runs alone and should get about that much. Prints each group's share of
+ * the CPU time and exits. The shares are checked on one CPU only: idle CPUs
+ * steal threads, not groups, and other CPUs than CPU 0 notice a group out of
+ * quota only at their next clock tick.
+ *
+ * USAGE: ./group_test [ms] [threads] [cpus]
+ *
+ * where [ms] is how long each part lasts (default 500), [threads] is the
+ * number of threads of the bigger tenant (default 100) and [cpus] is the
+ * number of virtual CPUs (default 1).
+ */
+
+#include "minithread.h"
+#include "interrupts.h"
+#include "scheduler.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+int duration = 500;
+int threads = 100;
+int ncpu = 1;
+volatile int done;
+int failures = 0;
+
+/*
+ * Compute for about ns nanoseconds. This counts cycles rather than reading
+ * the clock, because interrupts that arrive inside the C library are lost.
+ */
+double cycles_per_ns;
+
+void spin(uint64_t ns) {
+    uint64_t end = minithread_cycles() + (uint64_t) (ns * cycles_per_ns);
+    while (minithread_cycles() < end)
+        ;
+}
+
+int hog(int* arg) {
+    while (!done) {
+        spin(100 * MICROSECOND);
+        minithread_yield();
+    }
+    return 0;
+}
+
+/* Fork *arg hogs, which stay in our group, and wait for them */
+int tenant(int* arg) {
+    minithread_t **t = (minithread_t **) malloc(*arg * sizeof(*t));
+    int i;
+
+    for (i = 0; i < *arg; i++)
+        t[i] = minithread_fork_joinable(hog, NULL);
+    for (i = 0; i < *arg; i++)
+        minithread_join(t[i], NULL);
+    free(t);
+    return 0;
+}
+
+/*
+ * Run a tenant of n[i] threads in group g[i] for a while, and store the CPU
+ * time each group got in it in ms[i]
+ */
+void run(minithread_group_t **g, int *n, int groups, double *ms) {
+    minithread_group_stats_t before[2], after;
+    minithread_t *t[2];
+    int i;
+
+    done = 0;
+    for (i = 0; i < groups; i++) {
+        minithread_group_stats(g[i], &before[i]);
+        t[i] = minithread_create_joinable(tenant, &n[i]);
+        minithread_set_group(t[i], g[i]);
+        minithread_start(t[i]);
+    }
+    minithread_sleep_for((uint64_t) duration * MILLISECOND);
+    for (i = 0; i < groups; i++) {
+        minithread_group_stats(g[i], &after);
+        ms[i] = (double) (after.cpu_time - before[i].cpu_time) / MILLISECOND;
+    }
+    done = 1;
+    for (i = 0; i < groups; i++)
+        minithread_join(t[i], NULL);
+}
+
+/* Split the CPU between a tenant of one thread and one of many */
+void share(int weight) {
+    minithread_group_t *g[2];
+    int n[2] = {1, threads};
+    double ms[2], expected = 100.0 * weight / (weight + 1), got;
+
+    g[0] = minithread_group_create(weight * SCHED_WEIGHT_DEFAULT);
+    g[1] = minithread_group_create(SCHED_WEIGHT_DEFAULT);
+    run(g, n, 2, ms);
+    got = 100.0 * ms[0] / (ms[0] + ms[1]);
+    printf("share:   1 thread of weight %d got %5.1f%%, %d threads of weight "
+           "1 got %5.1f%%, expected %5.1f%%\n",
+           weight, got, threads, 100.0 - got, expected);
+    if (ncpu == 1 && (got < expected - 10 || got > expected + 10))
+        failures++;
+}
+
+/* Run a tenant alone with a quota of a fifth of the CPU */
+void quota() {
+    minithread_group_t *g = minithread_group_create(SCHED_WEIGHT_DEFAULT);
+    minithread_group_stats_t stats;
+    int n = threads;
+    double ms, got;
+
+    minithread_group_set_quota(g, 4 * MILLISECOND, 20 * MILLISECOND);
+    run(&g, &n, 1, &ms);
+    minithread_group_stats(g, &stats);
+    got = 100.0 * ms / duration;
+    printf("quota:   %d threads got %5.1f%% of the time, expected 20.0%%, "
+           "throttled %llu times\n",
+           threads, got, (unsigned long long) stats.throttles);
+    if ((ncpu == 1 && (got < 10 || got > 30)) || stats.throttles == 0 ||
+        stats.threads != 0)
+        failures++;
+}
+
+int test(int* arg) {
+    uint64_t start = minithread_clock_now(), cycles = minithread_cycles();
+
+    minithread_sleep_for(10 * MILLISECOND);
+    cycles_per_ns = (double) (minithread_cycles() - cycles) /
+        (minithread_clock_now() - start);
+
+    share(1);
+    share(2);
+    quota();
+
+    printf("%d failures\n", failures);
+    exit(failures > 0);
+}
+
+int main(int argc, char *argv[]) {
+    if (argc > 1)
+        duration = atoi(argv[1]);
+    if (argc > 2)
+        threads = atoi(argv[2]);
+    if (argc > 3) {
+        ncpu = atoi(argv[3]);
+        minithread_set_cpus(ncpu);
+    }
+
+    minithread_system_initialize(test, NULL);
+    return -1;
+}
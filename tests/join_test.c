@@ -0,0 +1,76 @@
+/* join_test.c
+ *
+ * Join test. Forks threads that return a value right away, after sleeping
+ * or after yielding for a while, detaches every fourth one and joins the
+ * others both before and after they finish. Checks the values joined and
+ * that a thread cannot join itself, prints the result and exits.
+ *
+ * USAGE: ./join_test [threads] [cpus]
+ *
+ * where [threads] is the number of threads to fork (default 1000) and
+ * [cpus] is the number of virtual CPUs (default 1).
+ */
+
+#include "minithread.h"
+#include "interrupts.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+int threads = 1000;
+
+int child(int* arg) {
+    int i = *arg;
+
+    if (i % 3 == 1)
+        minithread_sleep_for((i % 7) * MILLISECOND);
+    else if (i % 3 == 2)
+        for (; i > 0; i -= 100)
+            minithread_yield();
+    return *arg * 2;
+}
+
+int test(int* arg) {
+    minithread_t **t = (minithread_t **) malloc(threads * sizeof(*t));
+    int *args = (int *) malloc(threads * sizeof(int));
+    int i, ret, failed = 0;
+
+    for (i = 0; i < threads; i++) {
+        args[i] = i;
+        t[i] = minithread_fork_joinable(child, &args[i]);
+        if (i % 4 == 3)
+            minithread_detach(t[i]);
+    }
+    // Let the quick ones finish before they are joined
+    minithread_yield();
+
+    for (i = threads - 1; i >= 0; i--) {
+        if (i % 4 == 3)
+            continue;
+        if (minithread_join(t[i], &ret) == -1 || ret != i * 2) {
+            printf("joining thread %d failed\n", i);
+            failed++;
+        }
+    }
+    if (minithread_join(minithread_self(), &ret) != -1) {
+        printf("a thread joined itself\n");
+        failed++;
+    }
+    if (minithread_join(NULL, &ret) != -1) {
+        printf("joined NULL\n");
+        failed++;
+    }
+
+    printf("%d threads joined, %d failures\n", threads - threads / 4, failed);
+    exit(failed > 0);
+}
+
+int main(int argc, char *argv[]) {
+    if (argc > 1)
+        threads = atoi(argv[1]);
+    if (argc > 2)
+        minithread_set_cpus(atoi(argv[2]));
+
+    minithread_system_initialize(test, NULL);
+    return -1;
+}
@@ -0,0 +1,193 @@
+/* lock_test.c
+ *
+ * Lock test. Threads bump a counter under a mutex, yielding inside the
+ * critical section; producers and consumers pass items through a bounded
+ * buffer guarded by a mutex and two condition variables; readers check that
+ * two counters kept equal by writers under a reader-writer lock never
+ * differ, and count how many of them hold the lock at once. Prints the
+ * result of each part and exits.
+ *
+ * USAGE: ./lock_test [threads] [rounds] [cpus]
+ *
+ * where [threads] is the number of threads in each part (default 8),
+ * [rounds] is how often each thread takes a lock (default 10000) and
+ * [cpus] is the number of virtual CPUs (default 1).
+ */
+
+#include "minithread.h"
+#include "synch.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#define BUFFER_SIZE 16
+
+int threads = 8;
+int rounds = 10000;
+int failures = 0;
+
+mutex_t *mutex;
+int counter = 0;
+
+cond_t *not_empty, *not_full;
+int buffer[BUFFER_SIZE];
+int head = 0, count = 0;
+long consumed = 0;
+
+rwlock_t *rwlock;
+int a = 0, b = 0;
+volatile int readers = 0, max_readers = 0;
+
+int counter_thread(int* arg) {
+    int i, c;
+
+    for (i = 0; i < rounds; i++) {
+        mutex_lock(mutex);
+        c = counter;
+        if (i % 16 == 0)
+            minithread_yield();
+        counter = c + 1;
+        if (mutex_unlock(mutex) == -1)
+            failures++;
+    }
+    return 0;
+}
+
+int producer(int* arg) {
+    int i;
+
+    for (i = 1; i <= rounds; i++) {
+        mutex_lock(mutex);
+        while (count == BUFFER_SIZE)
+            cond_wait(not_full, mutex);
+        buffer[(head + count++) % BUFFER_SIZE] = i;
+        cond_signal(not_empty);
+        mutex_unlock(mutex);
+    }
+    return 0;
+}
+
+int consumer(int* arg) {
+    int i;
+
+    for (i = 0; i < rounds; i++) {
+        mutex_lock(mutex);
+        while (count == 0)
+            cond_wait(not_empty, mutex);
+        consumed += buffer[head];
+        head = (head + 1) % BUFFER_SIZE;
+        count--;
+        cond_signal(not_full);
+        mutex_unlock(mutex);
+    }
+    return 0;
+}
+
+int reader(int* arg) {
+    int i;
+
+    for (i = 0; i < rounds; i++) {
+        rwlock_read_lock(rwlock);
+        mutex_lock(mutex);
+        if (++readers > max_readers)
+            max_readers = readers;
+        mutex_unlock(mutex);
+        if (a != b)
+            failures++;
+        minithread_yield();
+        if (a != b)
+            failures++;
+        mutex_lock(mutex);
+        readers--;
+        mutex_unlock(mutex);
+        rwlock_read_unlock(rwlock);
+    }
+    return 0;
+}
+
+int writer(int* arg) {
+    int i;
+
+    for (i = 0; i < rounds / 4; i++) {
+        rwlock_write_lock(rwlock);
+        if (readers != 0)
+            failures++;
+        a++;
+        minithread_yield();
+        b++;
+        rwlock_write_unlock(rwlock);
+        minithread_yield();
+    }
+    return 0;
+}
+
+/* Fork n threads running proc and join them all */
+void run(proc_t proc, int n) {
+    minithread_t **t = (minithread_t **) malloc(n * sizeof(*t));
+    int i;
+
+    for (i = 0; i < n; i++)
+        t[i] = minithread_fork_joinable(proc, NULL);
+    for (i = 0; i < n; i++)
+        minithread_join(t[i], NULL);
+    free(t);
+}
+
+int both(int* arg) {
+    if (*arg)
+        run(writer, threads / 4 > 0 ? threads / 4 : 1);
+    else
+        run(reader, threads);
+    return 0;
+}
+
+int test(int* arg) {
+    minithread_t *t[2];
+    int i, which[2] = {0, 1};
+    long expected = 0;
+
+    mutex = mutex_create();
+    not_empty = cond_create();
+    not_full = cond_create();
+    rwlock = rwlock_create();
+
+    run(counter_thread, threads);
+    printf("mutex:   counter %d, expected %d\n", counter, threads * rounds);
+    if (counter != threads * rounds)
+        failures++;
+    if (mutex_unlock(mutex) != -1 || mutex_trylock(mutex) != 0 ||
+        mutex_owner(mutex) != minithread_self() || mutex_unlock(mutex) != 0)
+        failures++;
+
+    for (i = 0; i < threads; i++) {
+        minithread_fork(producer, NULL);
+        expected += (long) rounds * (rounds + 1) / 2;
+    }
+    run(consumer, threads);
+    printf("cond:    consumed %ld, expected %ld\n", consumed, expected);
+    if (consumed != expected)
+        failures++;
+
+    for (i = 0; i < 2; i++)
+        t[i] = minithread_fork_joinable(both, &which[i]);
+    for (i = 0; i < 2; i++)
+        minithread_join(t[i], NULL);
+    printf("rwlock:  %d writes, up to %d readers at once\n", a, max_readers);
+    if (a != b)
+        failures++;
+
+    printf("%d failures\n", failures);
+    exit(failures > 0);
+}
+
+int main(int argc, char *argv[]) {
+    if (argc > 1)
+        threads = atoi(argv[1]);
+    if (argc > 2)
+        rounds = atoi(argv[2]);
+    if (argc > 3)
+        minithread_set_cpus(atoi(argv[3]));
+
+    minithread_system_initialize(test, NULL);
+    return -1;
+}
@@ -0,0 +1,155 @@
+/* mlfq_test.c
+ *
+ * Multilevel feedback queue test. With a few settings of the quanta and
+ * levels (see sched_mlfq_tune), counts how many turns a thread that keeps
+ * yielding takes to sink to the last level. Then checks that such a thread
+ * rises again once it starts sleeping, and counts how often two yielding
+ * threads are boosted back to level 0 in a while. Prints the results and
+ * exits.
+ *
+ * USAGE: ./mlfq_test [ms] [boost ms]
+ *
+ * where [ms] is how long the boost part lasts (default 1000) and [boost ms]
+ * is the boost interval in it (default 200).
+ */
+
+#include "minithread.h"
+#include "interrupts.h"
+#include "scheduler.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+int duration = 1000;
+int boost = 200;
+volatile int done;
+int failures = 0;
+
+/* Keeps yielding, so the others have someone to yield to */
+int yielder(int* arg) {
+    while (!done)
+        minithread_yield();
+    return 0;
+}
+
+/* Yield until at the last level in use, return how many turns it took */
+int sinker(int* arg) {
+    int turns = 0;
+
+    while (minithread_level(minithread_self()) < *arg - 1) {
+        minithread_yield();
+        turns++;
+    }
+    return turns;
+}
+
+void sink(int levels, int q0, int q1, int q2, int q3) {
+    mlfq_params_t params;
+    minithread_t *t[2];
+    int i, turns, expected = 0;
+
+    sched_mlfq_params(&params);
+    params.levels = levels;
+    params.quantum[0] = q0;
+    params.quantum[1] = q1;
+    params.quantum[2] = q2;
+    params.quantum[3] = q3;
+    if (sched_mlfq_tune(&params) == -1) {
+        printf("sink:    tuning failed\n");
+        failures++;
+        return;
+    }
+    for (i = 0; i < levels - 1; i++)
+        expected += params.quantum[i];
+
+    done = 0;
+    t[0] = minithread_fork_joinable(yielder, NULL);
+    t[1] = minithread_fork_joinable(sinker, &levels);
+    minithread_join(t[1], &turns);
+    done = 1;
+    minithread_join(t[0], NULL);
+    printf("sink:    %3d turns to level %d with quanta %d %d %d %d, "
+           "expected %d\n", turns, levels - 1, q0, q1, q2, q3, expected);
+    if (turns != expected)
+        failures++;
+}
+
+/* Sink, then sleep a few times, yielding after each sleep */
+int riser(int* arg) {
+    int sunk, level, sleeps;
+
+    while (minithread_level(minithread_self()) < MINITHREAD_LEVELS - 1)
+        minithread_yield();
+    sunk = minithread_level(minithread_self());
+    for (sleeps = 1; sleeps <= 3; sleeps++) {
+        minithread_sleep_for(MILLISECOND);
+        minithread_yield();
+        level = minithread_level(minithread_self());
+        printf("promote: level %d after sinking to %d and %d sleeps\n",
+               level, sunk, sleeps);
+    }
+    if (level >= sunk)
+        failures++;
+    return 0;
+}
+
+/* Yield and count how often the level went up */
+int booster(int* arg) {
+    int level, last = 0, rises = 0;
+
+    while (!done) {
+        minithread_yield();
+        level = minithread_level(minithread_self());
+        if (level < last)
+            rises++;
+        last = level;
+    }
+    return rises;
+}
+
+int test(int* arg) {
+    mlfq_params_t params, defaults;
+    minithread_t *t[2];
+    int rises[2];
+
+    sched_mlfq_params(&defaults);
+    sink(4, 1, 2, 4, 8);
+    sink(4, 2, 4, 8, 16);
+    sink(3, 3, 3, 3, 3);
+    sched_mlfq_tune(&defaults);
+
+    done = 0;
+    t[0] = minithread_fork_joinable(yielder, NULL);
+    t[1] = minithread_fork_joinable(riser, NULL);
+    minithread_join(t[1], NULL);
+    done = 1;
+    minithread_join(t[0], NULL);
+
+    params = defaults;
+    params.boost_interval = (uint64_t) boost * MILLISECOND;
+    sched_mlfq_tune(&params);
+    done = 0;
+    t[0] = minithread_fork_joinable(booster, NULL);
+    t[1] = minithread_fork_joinable(booster, NULL);
+    minithread_sleep_for((uint64_t) duration * MILLISECOND);
+    done = 1;
+    minithread_join(t[0], &rises[0]);
+    minithread_join(t[1], &rises[1]);
+    printf("boost:   %d and %d boosts in %d ms with an interval of %d ms\n",
+           rises[0], rises[1], duration, boost);
+    if (rises[0] == 0 || rises[1] == 0)
+        failures++;
+
+    printf("%d failures\n", failures);
+    exit(failures > 0);
+}
+
+int main(int argc, char *argv[]) {
+    if (argc > 1)
+        duration = atoi(argv[1]);
+    if (argc > 2)
+        boost = atoi(argv[2]);
+
+    minithread_system_initialize(test, NULL);
+    return -1;
+}
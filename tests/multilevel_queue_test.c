@@ -1,28 +1,30 @@
 #include <stdlib.h>
 #include <stdio.h>
 
-#include "tests.h"
+#include "queue.h"
+#include "multilevel_queue.h"
 
-/* Definition of multilevel queue */
-typedef struct multilevel_queue {
-    int total_level;
-    queue_t **mul_queue;
-} multilevel_queue_t;
+typedef struct item {
+    int val;
+} item_t;
+
+int failures = 0;
+
+/* Helper function to print out an item of a queue */
+void printi(void *item, void *count) {
+    item_t *x = (item_t *) item;
+    if (--*(int *) count == 0)
+        printf("%d", x->val);
+    else
+        printf("%d, ", x->val);
+}
 
 /* Helper function to print out queue */
 void printq(queue_t* q, int i) {
-    if (q != NULL && q -> size != 0) {
-        printf("Queue %d length is: %d\n", i, queue_length(q));
-        node_t* curr = q -> head;
-        item_t *x = (item_t *) (curr -> item);
-        while (curr != NULL) {
-            item_t *x = (item_t *) (curr -> item);
-            if (curr -> next == NULL) 
-                printf("%d", x->val);    
-            else
-                printf("%d, ", x->val);
-            curr = curr -> next;
-        }
+    int count = queue_length(q);
+    if (count > 0) {
+        printf("Queue %d length is: %d\n", i, count);
+        queue_iterate(q, printi, &count);
         printf("\n");
     } else {
         printf("Queue %d is empty.\n", i);
@@ -37,6 +39,18 @@ void multilevel_queue_printq(multilevel_queue_t *q, int level) {
     } 
 }
 
+/* Dequeue from q starting at level, and check what comes out */
+void check_dequeue(multilevel_queue_t *q, int level, int expected_level,
+                   item_t *expected) {
+    item_t *x;
+    int got = multilevel_queue_dequeue(q, level, (void **)&x);
+    if (got != expected_level || x != expected) {
+        printf("dequeue from level %d got level %d, expected %d\n",
+               level, got, expected_level);
+        failures++;
+    }
+}
+
 int main() {
     item_t item1 = {1};
     item_t item2 = {2};
@@ -132,5 +146,24 @@ int main() {
 
     multilevel_queue_enqueue(m_q, 1, &item7);
     multilevel_queue_printq(m_q, 4);
-    return 0;
-} 
\ No newline at end of file
+
+    // Test a multilevel queue with more levels than one bitmap word
+    // Q5: 11
+    // Q70: 12
+    // Q139: 9
+    printf("\n\nTesting multilevel_queue with 140 levels\n");
+    multilevel_queue_t *big_q = multilevel_queue_new(140);
+    multilevel_queue_enqueue(big_q, 70, &item12);
+    multilevel_queue_enqueue(big_q, 5, &item11);
+    multilevel_queue_enqueue(big_q, 139, &item9);
+    check_dequeue(big_q, 100, 139, &item9);
+    check_dequeue(big_q, 71, 5, &item11);
+    check_dequeue(big_q, 6, 70, &item12);
+    check_dequeue(big_q, 0, -1, NULL);
+    if (multilevel_queue_length(big_q) != 0)
+        failures++;
+    multilevel_queue_free(big_q);
+
+    printf("%d failures\n", failures);
+    return failures > 0;
+}
@@ -0,0 +1,122 @@
+/* network_bench.c
+ *
+ * Network benchmark. A child process floods our UDP port with minimsg
+ * datagrams over 127.0.0.1 for a while, as fast as it can send them, and a
+ * thread receives them with minimsg_receive. Prints how many packets each
+ * side got through per second, and exits.
+ *
+ * USAGE: ./network_bench <port> [ms] [size] [batch] [queue]
+ *
+ * where <port> is the UDP port to listen on (the child uses the next one),
+ * [ms] is how long the child sends (default 1000), [size] is the size of
+ * each message, in bytes (default 64), [batch] is how many packets we
+ * receive per system call (default 32) and [queue] is the length of the
+ * child's transmit queue (default 0, none).
+ *
+ * Packets the socket has no room for are dropped by the host, so the rate
+ * received is the most we keep up with.
+ */
+
+#include "minithread.h"
+#include "interrupts.h"
+#include "minimsg.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#define START_DELAY 200         /* ms the child waits for us to start */
+
+short udp_port;
+int duration = 1000;
+int size = 64;
+
+miniport_t *port;
+volatile int received = 0;
+uint64_t first, last;
+
+/* Child: send datagrams to port 0 of the parent for duration ms */
+int flood(int* arg) {
+    char buffer[MINIMSG_MAX_MSG_SIZE];
+    network_address_t addr;
+    miniport_t *from, *to;
+    uint64_t end;
+    long sent = 0;
+
+    memset(buffer, 0, sizeof(buffer));
+    network_translate_hostname("127.0.0.1", addr);
+    from = miniport_create_unbound(1);
+    to = miniport_create_bound(addr, 0);
+
+    minithread_sleep_for(START_DELAY * MILLISECOND);
+    end = minithread_clock_now() + (uint64_t) duration * MILLISECOND;
+    while (minithread_clock_now() < end) {
+        if (minimsg_send(from, to, buffer, size) == size)
+            sent++;
+    }
+    printf("sent:     %8ld packets, %8.0f packets/s\n", sent,
+           sent * 1000.0 / duration);
+    exit(0);
+}
+
+int receive(int* arg) {
+    char buffer[MINIMSG_MAX_MSG_SIZE];
+    miniport_t *from;
+    int length;
+
+    for (;;) {
+        length = size;
+        minimsg_receive(port, &from, buffer, &length);
+        miniport_destroy(from);
+        last = minithread_clock_now();
+        if (received++ == 0)
+            first = last;
+    }
+    return 0;
+}
+
+int test(int* arg) {
+    port = miniport_create_unbound(0);
+    minithread_fork(receive, NULL);
+
+    // Wait for the child to finish and the packets in flight to arrive. A
+    // blocking wait would keep us from taking interrupts meanwhile.
+    minithread_sleep_for((uint64_t) (START_DELAY + duration + 100) *
+                         MILLISECOND);
+    wait(NULL);
+
+    printf("received: %8d packets, %8.0f packets/s\n", received,
+           received > 1 ? (received - 1) * (double) SECOND / (last - first)
+                        : 0.0);
+    exit(received == 0);
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 2) {
+        printf("USAGE: %s <port> [ms] [size] [batch] [queue]\n", argv[0]);
+        return -1;
+    }
+    udp_port = atoi(argv[1]);
+    if (argc > 2)
+        duration = atoi(argv[2]);
+    if (argc > 3)
+        size = atoi(argv[3]);
+    if (size < 0 || size > MINIMSG_MAX_MSG_SIZE)
+        size = MINIMSG_MAX_MSG_SIZE;
+    if (argc > 4)
+        network_recv_batch(atoi(argv[4]));
+
+    fflush(stdout);
+    if (fork() == 0) {
+        if (argc > 5)
+            network_tx_queue(atoi(argv[5]));
+        network_udp_ports(udp_port + 1, udp_port);
+        minithread_system_initialize(flood, NULL);
+    }
+
+    network_udp_ports(udp_port, udp_port + 1);
+    minithread_system_initialize(test, NULL);
+    return -1;
+}
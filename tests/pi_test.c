@@ -0,0 +1,161 @@
+/* pi_test.c
+ *
+ * Priority inversion test. A CPU hog, demoted to the lowest level, keeps
+ * taking a lock and computing while holding it. Pairs of threads play
+ * semaphore ping-pong with some work between passes, so there is always
+ * level 0 work. A thread that wakes up every few milliseconds takes the
+ * lock and measures how long it waited. The test runs once with a semaphore
+ * as the lock and once with a mutex, which lends the waiter's level to the
+ * hog, prints the mean and worst wait of each and exits.
+ *
+ * USAGE: ./pi_test [ms] [background]
+ *
+ * where [ms] is how long each run lasts (default 2000) and [background] is
+ * the number of ping-pong threads (default 4).
+ */
+
+#include "minithread.h"
+#include "interrupts.h"
+#include "synch.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+int duration = 2000;
+int background = 4;
+volatile int done;
+
+semaphore_t *sem;
+mutex_t *mutex;
+int use_mutex;
+
+semaphore_t **balls;
+
+void lock() {
+    if (use_mutex)
+        mutex_lock(mutex);
+    else
+        semaphore_P(sem);
+}
+
+void unlock() {
+    if (use_mutex)
+        mutex_unlock(mutex);
+    else
+        semaphore_V(sem);
+}
+
+/* 
+ * Compute for about ns nanoseconds. This counts cycles rather than reading
+ * the clock, because interrupts that arrive inside the C library are lost.
+ */
+double cycles_per_ns;
+
+void spin(uint64_t ns) {
+    uint64_t end = minithread_cycles() + (uint64_t) (ns * cycles_per_ns);
+    while (minithread_cycles() < end)
+        ;
+}
+
+int hog(int* arg) {
+    // Run out the quanta of every level first
+    while (minithread_level(minithread_self()) < MINITHREAD_LEVELS - 1)
+        ;
+    while (!done) {
+        lock();
+        spin(2 * MILLISECOND);
+        unlock();
+        spin(100 * MICROSECOND);
+    }
+    return 0;
+}
+
+/* Background thread i plays with thread i ^ 1 */
+int player(int* arg) {
+    int i = *arg;
+
+    while (!done) {
+        semaphore_V(balls[i ^ 1]);
+        semaphore_P(balls[i]);
+        spin(200 * MICROSECOND);
+    }
+    semaphore_V(balls[i ^ 1]);
+    return 0;
+}
+
+int waiter(int* arg) {
+    uint64_t start, wait, total = 0, worst = 0;
+    int n = 0;
+
+    while (!done) {
+        minithread_sleep_for(3 * MILLISECOND);
+        start = minithread_clock_now();
+        lock();
+        unlock();
+        wait = minithread_clock_now() - start;
+        total += wait;
+        if (wait > worst)
+            worst = wait;
+        n++;
+    }
+    printf("%-10s %5d waits, %8.1f us on average, %8.1f us at most\n",
+           use_mutex ? "mutex" : "semaphore", n,
+           n > 0 ? (double) total / n / MICROSECOND : 0.0,
+           (double) worst / MICROSECOND);
+    return 0;
+}
+
+void run() {
+    minithread_t *t[2];
+    int *args = (int *) malloc(background * sizeof(int));
+    int i;
+
+    done = 0;
+    balls = (semaphore_t **) malloc(background * sizeof(semaphore_t *));
+    for (i = 0; i < background; i++) {
+        balls[i] = semaphore_create();
+        semaphore_initialize(balls[i], 0);
+    }
+    for (i = 0; i < background; i++) {
+        args[i] = i;
+        minithread_fork(player, &args[i]);
+    }
+    t[0] = minithread_fork_joinable(hog, NULL);
+    // Let the hog sink to the lowest level before measuring
+    while (minithread_level(t[0]) < MINITHREAD_LEVELS - 1)
+        minithread_sleep_for(10 * MILLISECOND);
+    t[1] = minithread_fork_joinable(waiter, NULL);
+    minithread_sleep_for((uint64_t) duration * MILLISECOND);
+    done = 1;
+    minithread_join(t[0], NULL);
+    minithread_join(t[1], NULL);
+}
+
+int test(int* arg) {
+    uint64_t start = minithread_clock_now(), cycles = minithread_cycles();
+
+    minithread_sleep_for(10 * MILLISECOND);
+    cycles_per_ns = (double) (minithread_cycles() - cycles) / 
+        (minithread_clock_now() - start);
+
+    sem = semaphore_create();
+    semaphore_initialize(sem, 1);
+    mutex = mutex_create();
+    background &= ~1;
+
+    use_mutex = 0;
+    run();
+    use_mutex = 1;
+    run();
+    exit(0);
+}
+
+int main(int argc, char *argv[]) {
+    if (argc > 1)
+        duration = atoi(argv[1]);
+    if (argc > 2)
+        background = atoi(argv[2]);
+
+    minithread_system_initialize(test, NULL);
+    return -1;
+}
@@ -0,0 +1,111 @@
+/* pipeline_bench.c
+ *
+ * Pipeline latency benchmark. Passes items one at a time down a chain of
+ * threads linked by semaphores, like the stages of sieve, while pairs of
+ * other threads play semaphore ping-pong in the background, so level 0 of
+ * the ready list is never empty. Runs once waking each stage with
+ * semaphore_V and once with semaphore_V_handoff, prints the mean end-to-end
+ * latency of each and exits.
+ *
+ * USAGE: ./pipeline_bench [stages] [items] [background]
+ *
+ * where [stages] is the length of the chain (default 8), [items] is the
+ * number of items sent down it in each run (default 2000) and [background]
+ * is the number of background threads (default 8).
+ */
+
+#include "minithread.h"
+#include "interrupts.h"
+#include "synch.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+int stages = 8;
+int items = 2000;
+int background = 8;
+volatile int done = 0;
+
+// Semaphore i wakes stage i, the last one wakes the source
+semaphore_t **sems;
+void (*wake)(semaphore_t *);
+
+int stage(int* arg) {
+    int i = *arg;
+
+    for (;;) {
+        semaphore_P(sems[i]);
+        wake(sems[i + 1]);
+    }
+    return 0;
+}
+
+// Background thread i plays with thread i ^ 1
+semaphore_t **balls;
+
+int player(int* arg) {
+    int i = *arg;
+
+    while (!done) {
+        semaphore_V(balls[i ^ 1]);
+        semaphore_P(balls[i]);
+    }
+    return 0;
+}
+
+void run(char *name, void (*v)(semaphore_t *)) {
+    uint64_t start, total = 0;
+    int i;
+
+    wake = v;
+    for (i = 0; i < items; i++) {
+        start = minithread_clock_now();
+        wake(sems[0]);
+        semaphore_P(sems[stages]);
+        total += minithread_clock_now() - start;
+    }
+    printf("%-20s %d stages, %8.1f us per item\n", name, stages,
+           (double) total / items / MICROSECOND);
+}
+
+int test(int* arg) {
+    int *args = (int *) malloc((stages + background) * sizeof(int));
+    int i;
+
+    sems = (semaphore_t **) malloc((stages + 1) * sizeof(semaphore_t *));
+    for (i = 0; i <= stages; i++) {
+        sems[i] = semaphore_create();
+        semaphore_initialize(sems[i], 0);
+    }
+    for (i = 0; i < stages; i++) {
+        args[i] = i;
+        minithread_fork(stage, &args[i]);
+    }
+    background &= ~1;
+    balls = (semaphore_t **) malloc(background * sizeof(semaphore_t *));
+    for (i = 0; i < background; i++) {
+        balls[i] = semaphore_create();
+        semaphore_initialize(balls[i], 0);
+    }
+    for (i = 0; i < background; i++) {
+        args[stages + i] = i;
+        minithread_fork(player, &args[stages + i]);
+    }
+
+    run("semaphore_V", semaphore_V);
+    run("semaphore_V_handoff", semaphore_V_handoff);
+    done = 1;
+    exit(0);
+}
+
+int main(int argc, char *argv[]) {
+    if (argc > 1)
+        stages = atoi(argv[1]);
+    if (argc > 2)
+        items = atoi(argv[2]);
+    if (argc > 3)
+        background = atoi(argv[3]);
+
+    minithread_system_initialize(test, NULL);
+    return -1;
+}
@@ -1,24 +1,26 @@
+#include <stddef.h>
 #include <stdlib.h>
 #include <stdio.h>
 
 #include "queue.h"
 
-struct node {
-    struct node* previous;
-    struct node* next;
-    void* item;
-};
-
 struct queue {
     node_t* head;
     node_t* tail;
     int size;
+    int link;
 };
 
 typedef struct item {
     int val;
 } item_t;
 
+/* Item for intrusive queues, val must stay first for printq */
+typedef struct link_item {
+    int val;
+    node_t link;
+} link_item_t;
+
 void printq(queue_t* q) {
     if (q != NULL && q -> size != 0) {
         printf("Queue length is: %d\n", queue_length(q));
@@ -150,5 +152,41 @@ int main() {
     p = &item1;
     printf("%d\n", queue_sorted_insert(qq, p, compare_int));
     printq(qq);
+
+    // test queue_new_intrusive()
+    // output should be
+    // 3 1 2 4
+    // 1 2 4
+    // 1 4
+    queue_t *iq = queue_new_intrusive(offsetof(link_item_t, link));
+    link_item_t litem1 = {1};
+    link_item_t litem2 = {2};
+    link_item_t litem3 = {3};
+    link_item_t litem4 = {4};
+    queue_append(iq, &litem1);
+    queue_append(iq, &litem2);
+    queue_prepend(iq, &litem3);
+    queue_sorted_insert(iq, &litem4, compare_int);
+    printq(iq);
+    queue_dequeue(iq, d);
+    printf("dequeue %d\n", ((link_item_t*)(*d)) -> val);
+    printq(iq);
+    queue_delete(iq, &litem2);
+    printq(iq);
+    ret = queue_delete(iq, &litem2);
+    printf("return code is: %d, should return -1\n", ret);
+    ret = queue_delete(iq, &litem3);
+    printf("return code is: %d, should return -1\n", ret);
+
+    // an item in another queue is not deleted, even at its head
+    queue_t *iq2 = queue_new_intrusive(offsetof(link_item_t, link));
+    queue_append(iq2, &litem2);
+    queue_append(iq2, &litem3);
+    ret = queue_delete(iq, &litem2);
+    printf("return code is: %d, should return -1\n", ret);
+    ret = queue_delete(iq, &litem3);
+    printf("return code is: %d, should return -1\n", ret);
+    printq(iq);
+    printq(iq2);
     return 0;   
 }
\ No newline at end of file
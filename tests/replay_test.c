@@ -0,0 +1,112 @@
+/* replay_test.c
+ *
+ * Interrupt replay test. Two CPU hogs spend most of their time with
+ * interrupts disabled, so most clock ticks and timer expiries arrive when
+ * they cannot be taken. Interrupts that could not be taken should run as
+ * soon as interrupts are enabled again, so first the hogs alone should be
+ * preempted about once per tick, then a real-time thread that sleeps 1 ms
+ * at a time should wake up less than two thirds of a critical section
+ * late on average. Prints both and exits.
+ *
+ * USAGE: ./replay_test [ms] [critical]
+ *
+ * where [ms] is how long each part lasts (default 2000) and [critical] is how
+ * long each critical section lasts, in microseconds (default 900).
+ */
+
+#include "minithread.h"
+#include "interrupts.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+int duration = 2000;
+int critical = 900;
+volatile int done;
+
+/*
+ * Compute for about ns nanoseconds. This counts cycles rather than reading
+ * the clock: an interrupt that arrives inside the C library is not taken
+ * there but replayed by the retry timer, and this test is about the ones
+ * replayed when a critical section enables interrupts again.
+ */
+double cycles_per_ns;
+
+void spin(uint64_t ns) {
+    uint64_t end = minithread_cycles() + (uint64_t) (ns * cycles_per_ns);
+    while (minithread_cycles() < end)
+        ;
+}
+
+int hog(int* arg) {
+    interrupt_level_t old_level;
+
+    while (!done) {
+        old_level = set_interrupt_level(DISABLED);
+        spin((uint64_t) critical * MICROSECOND);
+        set_interrupt_level(old_level);
+        spin(50 * MICROSECOND);
+    }
+    return 0;
+}
+
+int sleeper(int* arg) {
+    uint64_t start, late, max = 0, total = 0;
+    int n = 0;
+
+    while (!done) {
+        start = minithread_clock_now();
+        minithread_sleep_for(MILLISECOND);
+        late = minithread_clock_now() - start - MILLISECOND;
+        total += late;
+        if (late > max)
+            max = late;
+        n++;
+    }
+    printf("sleep:   %d sleeps of 1 ms, %lu us late on average, %lu us at "
+           "most\n", n, (unsigned long) (total / n / MICROSECOND),
+           (unsigned long) (max / MICROSECOND));
+    return total / n > (uint64_t) critical * MICROSECOND * 2 / 3;
+}
+
+int test(int* arg) {
+    uint64_t start = minithread_clock_now(), cycles = minithread_cycles();
+    minithread_t *t[3];
+    minithread_stats_t stats;
+    int i, late, preempted = 0, expected = duration * MILLISECOND / PERIOD;
+
+    minithread_sleep_for(10 * MILLISECOND);
+    cycles_per_ns = (double) (minithread_cycles() - cycles) /
+        (minithread_clock_now() - start);
+
+    t[0] = minithread_fork_joinable(hog, NULL);
+    t[1] = minithread_fork_joinable(hog, NULL);
+    minithread_sleep_for((uint64_t) duration * MILLISECOND);
+    for (i = 0; i < 2; i++) {
+        minithread_stats(t[i], &stats);
+        preempted += stats.involuntary_switches;
+    }
+    printf("ticks:   hogs preempted %d times in %d ticks\n", preempted,
+           expected);
+
+    // Real-time, so it preempts the hogs as soon as its wakeup is taken
+    t[2] = minithread_create_joinable(sleeper, NULL);
+    minithread_set_deadline(t[2], 10 * MILLISECOND, MILLISECOND);
+    minithread_start(t[2]);
+    minithread_sleep_for((uint64_t) duration * MILLISECOND);
+    done = 1;
+    for (i = 0; i < 3; i++)
+        minithread_join(t[i], i == 2 ? &late : NULL);
+
+    exit(late || preempted < expected * 3 / 4);
+}
+
+int main(int argc, char *argv[]) {
+    if (argc > 1)
+        duration = atoi(argv[1]);
+    if (argc > 2)
+        critical = atoi(argv[2]);
+
+    minithread_system_initialize(test, NULL);
+    return -1;
+}
@@ -0,0 +1,120 @@
+/* sched_test.c
+ *
+ * Scheduler policy test. Three CPU-bound threads of weight 1, 2 and 4 times
+ * SCHED_WEIGHT_DEFAULT compute in short bursts, yielding between them, while
+ * another thread wakes up every millisecond. Prints the share of CPU time
+ * each CPU-bound thread got and how late the sleeper woke up, then exits.
+ * Under stride and cfs the shares should be about 1:2:4, under mlfq and rr
+ * about equal.
+ *
+ * USAGE: ./sched_test [policy] [ms] [cpus]
+ *
+ * where [policy] is mlfq, rr, stride or cfs (default mlfq), [ms] is how long
+ * the test lasts (default 1000) and [cpus] is the number of virtual CPUs
+ * (default 1).
+ */
+
+#include "minithread.h"
+#include "interrupts.h"
+#include "scheduler.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#define HOGS 3
+
+int duration = 1000;
+volatile int done = 0;
+
+/*
+ * Compute for about ns nanoseconds. This counts cycles rather than reading
+ * the clock, because interrupts that arrive inside the C library are lost.
+ */
+double cycles_per_ns;
+
+void spin(uint64_t ns) {
+    uint64_t end = minithread_cycles() + (uint64_t) (ns * cycles_per_ns);
+    while (minithread_cycles() < end)
+        ;
+}
+
+int hog(int* arg) {
+    while (!done) {
+        spin(100 * MICROSECOND);
+        minithread_yield();
+    }
+    return 0;
+}
+
+int sleeper(int* arg) {
+    uint64_t deadline, late, total = 0, worst = 0;
+    int n = 0;
+
+    while (!done) {
+        deadline = minithread_clock_now() + MILLISECOND;
+        minithread_sleep_until(deadline);
+        late = minithread_clock_now() - deadline;
+        total += late;
+        if (late > worst)
+            worst = late;
+        n++;
+    }
+    printf("sleeper: %d wakeups, %8.1f us late on average, %8.1f us at most\n",
+           n, n > 0 ? (double) total / n / MICROSECOND : 0.0,
+           (double) worst / MICROSECOND);
+    return 0;
+}
+
+int test(int* arg) {
+    minithread_t *hogs[HOGS], *t;
+    minithread_stats_t stats[HOGS];
+    uint64_t start = minithread_clock_now(), cycles = minithread_cycles();
+    uint64_t total = 0;
+    int i;
+
+    minithread_sleep_for(10 * MILLISECOND);
+    cycles_per_ns = (double) (minithread_cycles() - cycles) /
+        (minithread_clock_now() - start);
+
+    for (i = 0; i < HOGS; i++) {
+        hogs[i] = minithread_create_joinable(hog, NULL);
+        minithread_set_weight(hogs[i], SCHED_WEIGHT_DEFAULT << i);
+        minithread_start(hogs[i]);
+    }
+    t = minithread_fork_joinable(sleeper, NULL);
+    minithread_sleep_for((uint64_t) duration * MILLISECOND);
+    for (i = 0; i < HOGS; i++) {
+        minithread_stats(hogs[i], &stats[i]);
+        total += stats[i].cpu_time;
+    }
+    done = 1;
+    minithread_join(t, NULL);
+    for (i = 0; i < HOGS; i++)
+        minithread_join(hogs[i], NULL);
+
+    for (i = 0; i < HOGS; i++) {
+        printf("weight %5d: %8.1f ms, %5.1f%% of the hogs' time\n",
+               SCHED_WEIGHT_DEFAULT << i,
+               (double) stats[i].cpu_time / MILLISECOND,
+               100.0 * stats[i].cpu_time / total);
+    }
+    exit(0);
+}
+
+int main(int argc, char *argv[]) {
+    if (argc > 1) {
+        sched_ops_t *ops = sched_lookup(argv[1]);
+        if (ops == NULL) {
+            fprintf(stderr, "unknown policy %s\n", argv[1]);
+            return -1;
+        }
+        minithread_set_scheduler(ops);
+    }
+    if (argc > 2)
+        duration = atoi(argv[2]);
+    if (argc > 3)
+        minithread_set_cpus(atoi(argv[3]));
+
+    minithread_system_initialize(test, NULL);
+    return -1;
+}
@@ -9,6 +9,9 @@
  * filter thread for each new prime, which subsequently filters out
  * all multiples of that prime from the pipe.
  *
+ * USAGE: ./sieve [ncpus]
+ *
+ * where [ncpus] is the number of virtual CPUs to run on (default 1).
  */
 #include <stdlib.h>
 #include <stdio.h>
@@ -113,6 +116,8 @@ int sink(int* arg) {
 
 int
 main(int argc, char * argv[]) {
+  if (argc > 1)
+    minithread_set_cpus(atoi(argv[1]));
   minithread_system_initialize(sink, NULL);
   return -1;
 }
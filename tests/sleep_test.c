@@ -0,0 +1,53 @@
+/* sleep_test.c
+ *
+ * High-resolution sleep test. Sleeps for a range of delays, from far below
+ * one clock tick to more than one, and prints how late the wakeups were.
+ * Exits when done.
+ *
+ * USAGE: ./sleep_test [rounds]
+ *
+ * where [rounds] is the number of sleeps per delay (default 20).
+ */
+
+#include "minithread.h"
+#include "interrupts.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+int rounds = 20;
+
+uint64_t delays[] = {
+    50 * MICROSECOND, 200 * MICROSECOND, MILLISECOND, 10 * MILLISECOND,
+    150 * MILLISECOND
+};
+
+int sleeper(int* arg) {
+    uint64_t start, late, total, max;
+    int i, j;
+
+    for (i = 0; i < sizeof(delays) / sizeof(delays[0]); i++) {
+        total = max = 0;
+        for (j = 0; j < rounds; j++) {
+            start = minithread_clock_now();
+            minithread_sleep_for(delays[i]);
+            late = minithread_clock_now() - start - delays[i];
+            total += late;
+            if (late > max)
+                max = late;
+        }
+        printf("sleep %8lu us: %6lu us late on average, %6lu us at most\n",
+               (unsigned long) (delays[i] / MICROSECOND),
+               (unsigned long) (total / rounds / MICROSECOND),
+               (unsigned long) (max / MICROSECOND));
+    }
+    exit(0);
+}
+
+int main(int argc, char *argv[]) {
+    if (argc > 1)
+        rounds = atoi(argv[1]);
+
+    minithread_system_initialize(sleeper, NULL);
+    return -1;
+}
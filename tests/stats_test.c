@@ -0,0 +1,89 @@
+/* stats_test.c
+ *
+ * Scheduler accounting test. Runs a thread that computes without yielding,
+ * one that yields all the time and one that sleeps most of the time for a
+ * while, then prints the scheduler statistics of each and the run-queue
+ * latency histograms, and exits.
+ *
+ * USAGE: ./stats_test [ms]
+ *
+ * where [ms] is how long the threads run (default 2000).
+ */
+
+#include "minithread.h"
+#include "interrupts.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+int duration = 2000;
+volatile int done = 0;
+
+int hog(int* arg) {
+    while (!done)
+        ;
+    return 0;
+}
+
+int yielder(int* arg) {
+    while (!done)
+        minithread_yield();
+    return 0;
+}
+
+int sleeper(int* arg) {
+    while (!done)
+        minithread_sleep_for(MILLISECOND);
+    return 0;
+}
+
+void print_thread(char *name, minithread_t *t) {
+    minithread_stats_t s;
+    int level;
+
+    minithread_stats(t, &s);
+    printf("%-8s cpu %5lu ms, %7lu voluntary, %4lu involuntary, ready",
+           name, (unsigned long) (s.cpu_time / MILLISECOND),
+           (unsigned long) s.voluntary_switches,
+           (unsigned long) s.involuntary_switches);
+    for (level = 0; level < MINITHREAD_LEVELS; level++)
+        printf(" %5lu", (unsigned long) (s.wait_time[level] / MILLISECOND));
+    printf(" ms\n");
+}
+
+int test(int* arg) {
+    minithread_t *threads[3];
+    minithread_stats_t s;
+    int level, bucket;
+
+    threads[0] = minithread_fork(hog, NULL);
+    threads[1] = minithread_fork(yielder, NULL);
+    threads[2] = minithread_fork(sleeper, NULL);
+    minithread_sleep_for((uint64_t) duration * MILLISECOND);
+
+    print_thread("hog", threads[0]);
+    print_thread("yielder", threads[1]);
+    print_thread("sleeper", threads[2]);
+    done = 1;
+
+    minithread_stats(NULL, &s);
+    printf("run-queue latency, threads per level:\n");
+    for (bucket = 0; bucket < MINITHREAD_LATENCY_BUCKETS; bucket++) {
+        if (s.latency[0][bucket] + s.latency[1][bucket] + 
+            s.latency[2][bucket] + s.latency[3][bucket] == 0)
+            continue;
+        printf("  < %11lu ns:", 2UL << bucket);
+        for (level = 0; level < MINITHREAD_LEVELS; level++)
+            printf(" %8lu", (unsigned long) s.latency[level][bucket]);
+        printf("\n");
+    }
+    exit(0);
+}
+
+int main(int argc, char *argv[]) {
+    if (argc > 1)
+        duration = atoi(argv[1]);
+
+    minithread_system_initialize(test, NULL);
+    return -1;
+}
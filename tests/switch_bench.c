@@ -0,0 +1,113 @@
+/* switch_bench.c
+ *
+ * Context switch benchmark. Two threads ping-pong through a pair of
+ * semaphores, so every round is two blocking switches: each side blocks in
+ * semaphore_P and is woken by the other side's semaphore_V. Then the two
+ * switch primitives are timed on their own, ping-ponging between two
+ * stacks without going through the scheduler: minithread_switch, which
+ * saves every register, and minithread_switch_fast, which saves only the
+ * callee-saved ones. Prints the average cost of one switch for each, and of
+ * an uncontended semaphore_P and semaphore_V pair, and exits.
+ *
+ * USAGE: ./switch_bench [rounds]
+ *
+ * where [rounds] is the number of ping-pong rounds (default 1000000).
+ */
+
+#include "minithread.h"
+#include "synch.h"
+#include "interrupts.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+typedef void (*switch_t)(stack_pointer_t *, stack_pointer_t *);
+
+semaphore_t *ping = NULL;
+semaphore_t *pong = NULL;
+int rounds = 1000000;
+
+stack_pointer_t bench_sp;
+stack_pointer_t partner_sp;
+switch_t switch_fn;
+
+int ponger(int* arg) {
+    int i;
+    for (i = 0; i < rounds; i++) {
+        semaphore_P(ping);
+        semaphore_V(pong);
+    }
+    return 0;
+}
+
+/* Other end of the primitive ping-pong, runs on a bare stack */
+int partner(int* arg) {
+    while (1) {
+        set_interrupt_level(DISABLED);
+        switch_fn(&partner_sp, &bench_sp);
+    }
+    return 0;
+}
+
+void report(char *name, uint64_t elapsed) {
+    printf("%-24s %d rounds in %lu ms, %.1f ns per switch\n", name, rounds,
+           (unsigned long) elapsed, elapsed * 1000000.0 / (2.0 * rounds));
+}
+
+void bench_primitive(char *name, switch_t f) {
+    stack_pointer_t base;
+    uint64_t start;
+    int i;
+
+    switch_fn = f;
+    minithread_allocate_stack(&base, &partner_sp);
+    minithread_initialize_stack(&partner_sp, partner, NULL, NULL, NULL);
+
+    start = currentTimeMillis();
+    for (i = 0; i < rounds; i++) {
+        set_interrupt_level(DISABLED);
+        switch_fn(&bench_sp, &partner_sp);
+    }
+    report(name, currentTimeMillis() - start);
+}
+
+int pinger(int* arg) {
+    int i;
+    uint64_t start, elapsed;
+
+    minithread_fork(ponger, NULL);
+    minithread_yield();
+
+    start = currentTimeMillis();
+    for (i = 0; i < rounds; i++) {
+        semaphore_V(ping);
+        semaphore_P(pong);
+    }
+    report("semaphore ping-pong", currentTimeMillis() - start);
+
+    start = currentTimeMillis();
+    for (i = 0; i < rounds; i++) {
+        semaphore_V(ping);
+        semaphore_P(ping);
+    }
+    elapsed = currentTimeMillis() - start;
+    printf("%-24s %d rounds in %lu ms, %.1f ns per pair\n", "uncontended P/V",
+           rounds, (unsigned long) elapsed, elapsed * 1000000.0 / rounds);
+
+    bench_primitive("minithread_switch", minithread_switch);
+    bench_primitive("minithread_switch_fast", minithread_switch_fast);
+    exit(0);
+}
+
+int main(int argc, char *argv[]) {
+    if (argc > 1)
+        rounds = atoi(argv[1]);
+
+    ping = semaphore_create();
+    semaphore_initialize(ping, 0);
+    pong = semaphore_create();
+    semaphore_initialize(pong, 0);
+
+    minithread_system_initialize(pinger, NULL);
+    return -1;
+}
@@ -11,16 +11,11 @@
 #include "../queue.h"
 #include "../multilevel_queue.h"
 
-struct node {
-    struct node* previous;
-    struct node* next;
-    void* item;
-};
-
 struct queue {
     node_t* head;
     node_t* tail;
     int size;
+    int link;
 };
 
 typedef struct item {
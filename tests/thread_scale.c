@@ -0,0 +1,107 @@
+/* thread_scale.c
+ *
+ * Thread count scaling test. Forks [threads] threads that all block on a
+ * semaphore, reports the memory they take, then releases them and waits
+ * for all of them to finish. Prints the timings and exits.
+ *
+ * USAGE: ./thread_scale [threads] [stack size]
+ *
+ * where [threads] is the number of threads to fork (default 1000000) and
+ * [stack size] is the stack size of each thread in bytes (default 16384).
+ * Stack guard pages are turned off when the threads would not fit in
+ * vm.max_map_count.
+ */
+
+#include "minithread.h"
+#include "machineprimitives.h"
+#include "synch.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+semaphore_t *go = NULL;
+semaphore_t *done = NULL;
+int threads = 1000000;
+int stack_size = 16384;
+
+long resident_bytes() {
+    long size, resident = 0;
+    FILE *f = fopen("/proc/self/statm", "r");
+    if (f != NULL) {
+        if (fscanf(f, "%ld %ld", &size, &resident) != 2)
+            resident = 0;
+        fclose(f);
+    }
+    return resident * sysconf(_SC_PAGESIZE);
+}
+
+int child(int* arg) {
+    semaphore_P(go);
+    semaphore_V(done);
+    return 0;
+}
+
+int parent(int* arg) {
+    int i;
+    long rss;
+    uint64_t start, forked, finished;
+    minithread_t *t;
+
+    rss = resident_bytes();
+    start = currentTimeMillis();
+    for (i = 0; i < threads; i++) {
+        t = minithread_create_with_stack(child, NULL, stack_size);
+        if (t == NULL) {
+            printf("fork failed after %d threads\n", i);
+            exit(1);
+        }
+        minithread_start(t);
+    }
+    // Let every thread run up to its semaphore_P.
+    minithread_yield();
+    forked = currentTimeMillis();
+    rss = resident_bytes() - rss;
+    printf("%d threads blocked after %lu ms, %ld bytes resident per thread\n",
+           threads, (unsigned long) (forked - start), rss / threads);
+
+    for (i = 0; i < threads; i++)
+        semaphore_V(go);
+    for (i = 0; i < threads; i++)
+        semaphore_P(done);
+    finished = currentTimeMillis();
+    printf("%d threads finished after %lu ms\n", threads,
+           (unsigned long) (finished - forked));
+    exit(0);
+}
+
+int main(int argc, char *argv[]) {
+    long max_maps = 65530;
+    FILE *f;
+
+    if (argc > 1)
+        threads = atoi(argv[1]);
+    if (argc > 2)
+        stack_size = atoi(argv[2]);
+
+    // A guarded stack takes two mappings.
+    f = fopen("/proc/sys/vm/max_map_count", "r");
+    if (f != NULL) {
+        if (fscanf(f, "%ld", &max_maps) != 1)
+            max_maps = 65530;
+        fclose(f);
+    }
+    if (2L * threads > max_maps - 1000) {
+        printf("vm.max_map_count is %ld, disabling stack guard pages\n",
+               max_maps);
+        minithread_set_stack_guard(0);
+    }
+
+    go = semaphore_create();
+    semaphore_initialize(go, 0);
+    done = semaphore_create();
+    semaphore_initialize(done, 0);
+
+    minithread_system_initialize(parent, NULL);
+    return -1;
+}
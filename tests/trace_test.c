@@ -0,0 +1,118 @@
+/* trace_test.c
+ *
+ * Tracer test. Traces two threads playing semaphore ping-pong, a thread that
+ * sleeps in short steps and a stream of loopback datagrams for a while, then
+ * writes the trace and exits. Load the file in ui.perfetto.dev or
+ * chrome://tracing.
+ *
+ * USAGE: ./trace_test <port> [ms] [file]
+ *
+ * where <port> is the UDP port to use, [ms] is how long to trace (default
+ * 200) and [file] is where the trace goes (default trace.json).
+ */
+
+#include "minithread.h"
+#include "minimsg.h"
+#include "interrupts.h"
+#include "synch.h"
+#include "trace.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+int duration = 200;
+char *path = "trace.json";
+volatile int done = 0;
+semaphore_t *ping, *pong;
+miniport_t *listen_port;
+
+int pinger(int* arg) {
+    while (!done) {
+        semaphore_V(ping);
+        semaphore_P(pong);
+    }
+    return 0;
+}
+
+int ponger(int* arg) {
+    while (!done) {
+        semaphore_P(ping);
+        semaphore_V(pong);
+    }
+    return 0;
+}
+
+int sleeper(int* arg) {
+    while (!done)
+        minithread_sleep_for(100 * MICROSECOND);
+    return 0;
+}
+
+int sender(int* arg) {
+    network_address_t my_address;
+    miniport_t *send_port;
+    char text[] = "ping";
+
+    network_get_my_address(my_address);
+    send_port = miniport_create_bound(my_address, 0);
+    while (!done) {
+        minimsg_send(listen_port, send_port, text, sizeof(text));
+        minithread_sleep_for(MILLISECOND);
+    }
+    return 0;
+}
+
+int receiver(int* arg) {
+    char buffer[MINIMSG_MAX_MSG_SIZE];
+    miniport_t *from;
+    int length;
+
+    for (;;) {
+        length = MINIMSG_MAX_MSG_SIZE;
+        minimsg_receive(listen_port, &from, buffer, &length);
+        miniport_destroy(from);
+    }
+    return 0;
+}
+
+int test(int* arg) {
+    ping = semaphore_create();
+    pong = semaphore_create();
+    semaphore_initialize(ping, 0);
+    semaphore_initialize(pong, 0);
+    listen_port = miniport_create_unbound(0);
+
+    trace_start();
+    minithread_fork(pinger, NULL);
+    minithread_fork(ponger, NULL);
+    minithread_fork(sleeper, NULL);
+    minithread_fork(receiver, NULL);
+    minithread_fork(sender, NULL);
+    minithread_sleep_for((uint64_t) duration * MILLISECOND);
+    done = 1;
+
+    if (trace_dump(path) == -1) {
+        fprintf(stderr, "Failed to write %s\n", path);
+        exit(1);
+    }
+    printf("trace of %d ms written to %s\n", duration, path);
+    exit(0);
+}
+
+int main(int argc, char *argv[]) {
+    short port;
+
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s <port> [ms] [file]\n", argv[0]);
+        return -1;
+    }
+    port = atoi(argv[1]);
+    network_udp_ports(port, port);
+    if (argc > 2)
+        duration = atoi(argv[2]);
+    if (argc > 3)
+        path = argv[3];
+
+    minithread_system_initialize(test, NULL);
+    return -1;
+}
@@ -0,0 +1,185 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "interrupts.h"
+#include "machineprimitives.h"
+#include "trace.h"
+
+typedef struct trace_event {
+    uint64_t ts;            // cycles, see minithread_cycles
+    uint64_t type;
+    uint64_t a;
+    uint64_t b;
+} trace_event_t;
+
+typedef struct trace_ring {
+    char name[16];
+    volatile uint64_t head;     // events ever recorded, only its owner adds
+    trace_event_t events[TRACE_EVENTS];
+} trace_ring_t;
+
+volatile int trace_enabled = 0;
+
+static trace_ring_t *rings[TRACE_RINGS];
+static int nrings = 0;
+static __thread trace_ring_t *trace_ring;
+
+// Clock readings at trace_start, to convert cycles to time in trace_dump
+static uint64_t start_cycles;
+static uint64_t start_ns;
+
+void trace_attach(const char *name) {
+    trace_ring_t *ring;
+    int i;
+
+    if (trace_ring != NULL)
+        return;
+    if ((ring = (trace_ring_t *) calloc(1, sizeof(trace_ring_t))) == NULL) {
+        fprintf(stderr, "Failed to allocate a trace ring\n");
+        return;
+    }
+    strncpy(ring -> name, name, sizeof(ring -> name) - 1);
+    if ((i = __sync_fetch_and_add(&nrings, 1)) >= TRACE_RINGS) {
+        free(ring);
+        return;
+    }
+    rings[i] = ring;
+    trace_ring = ring;
+}
+
+void trace_start() {
+    int i;
+
+    trace_enabled = 0;
+    for (i = 0; i < nrings && i < TRACE_RINGS; i++) {
+        if (rings[i] != NULL)
+            rings[i] -> head = 0;
+    }
+    start_ns = minithread_clock_now();
+    start_cycles = minithread_cycles();
+    trace_enabled = 1;
+}
+
+void trace_stop() {
+    trace_enabled = 0;
+}
+
+void trace_record(trace_type_t type, uint64_t a, uint64_t b) {
+    trace_ring_t *ring = trace_ring;
+    trace_event_t *e;
+
+    if (ring == NULL)
+        return;
+    // A signal handler may record on top of us, so claim the slot first
+    e = &(ring -> events[__sync_fetch_and_add(&(ring -> head), 1) &
+                         (TRACE_EVENTS - 1)]);
+    e -> ts = minithread_cycles();
+    e -> type = type;
+    e -> a = a;
+    e -> b = b;
+}
+
+/* Write one event as JSON, the fields after "ph" come from fmt */
+static void trace_write(FILE *f, int *first, int tid, double ts,
+                        const char *name, const char *ph, const char *fmt,
+                        uint64_t a, uint64_t b) {
+    fprintf(f, "%s\n{\"name\":\"%s\",\"ph\":\"%s\",\"pid\":1,\"tid\":%d,"
+            "\"ts\":%.3f", *first ? "" : ",", name, ph, tid, ts);
+    if (fmt != NULL)
+        fprintf(f, fmt, a, b);
+    fprintf(f, "}");
+    *first = 0;
+}
+
+int trace_dump(const char *path) {
+    FILE *f;
+    trace_ring_t *ring;
+    trace_event_t *e;
+    uint64_t i, head, cycles, ns;
+    double us_per_cycle;
+    char name[32];
+    int r, first = 1;
+
+    trace_enabled = 0;
+    if ((f = fopen(path, "w")) == NULL)
+        return -1;
+    ns = minithread_clock_now();
+    cycles = minithread_cycles();
+    us_per_cycle = cycles > start_cycles ?
+        (double) (ns - start_ns) / (cycles - start_cycles) / 1000 : 0;
+
+    fprintf(f, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+    for (r = 0; r < nrings && r < TRACE_RINGS; r++) {
+        if ((ring = rings[r]) == NULL)
+            continue;
+        fprintf(f, "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,"
+                "\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+                first ? "" : ",", r, ring -> name);
+        first = 0;
+
+        head = ring -> head;
+        i = head > TRACE_EVENTS ? head - TRACE_EVENTS : 0;
+        for (; i < head; i++) {
+            e = &(ring -> events[i & (TRACE_EVENTS - 1)]);
+            // Skip anything from before trace_start
+            if (e -> ts < start_cycles)
+                continue;
+            double ts = (e -> ts - start_cycles) * us_per_cycle;
+
+            switch (e -> type) {
+            case TRACE_SCHEDULE:
+                trace_write(f, &first, r, ts, "schedule", "i",
+                            ",\"s\":\"t\",\"args\":{\"thread\":%lu,"
+                            "\"preempted\":%lu}", e -> a, e -> b);
+                break;
+            case TRACE_SWITCH:
+                snprintf(name, sizeof(name), "thread %lu", e -> a);
+                trace_write(f, &first, r, ts, name, "E", NULL, 0, 0);
+                snprintf(name, sizeof(name), "thread %lu", e -> b);
+                trace_write(f, &first, r, ts, name, "B", NULL, 0, 0);
+                break;
+            case TRACE_SEM_P:
+                trace_write(f, &first, r, ts, "semaphore_P", "i",
+                            ",\"s\":\"t\",\"args\":{\"sem\":\"0x%lx\","
+                            "\"blocked\":%lu}", e -> a, e -> b);
+                break;
+            case TRACE_SEM_V:
+                trace_write(f, &first, r, ts, "semaphore_V", "i",
+                            ",\"s\":\"t\",\"args\":{\"sem\":\"0x%lx\","
+                            "\"woke\":%lu}", e -> a, e -> b);
+                break;
+            case TRACE_ALARMS_BEGIN:
+                trace_write(f, &first, r, ts, "do_alarms", "B", NULL, 0, 0);
+                break;
+            case TRACE_ALARMS_END:
+                trace_write(f, &first, r, ts, "do_alarms", "E", NULL, 0, 0);
+                break;
+            case TRACE_NETWORK_BEGIN:
+                trace_write(f, &first, r, ts, "network_handler", "B",
+                            ",\"args\":{\"packet\":\"0x%lx\"}", e -> a, 0);
+                trace_write(f, &first, r, ts, "interrupt", "f",
+                            ",\"bp\":\"e\",\"cat\":\"irq\",\"id\":\"0x%lx\"",
+                            e -> a, 0);
+                break;
+            case TRACE_NETWORK_END:
+                trace_write(f, &first, r, ts, "network_handler", "E",
+                            NULL, 0, 0);
+                break;
+            case TRACE_INTERRUPT_BEGIN:
+                trace_write(f, &first, r, ts, "send_interrupt", "B",
+                            ",\"args\":{\"type\":%lu,\"arg\":\"0x%lx\"}",
+                            e -> a, e -> b);
+                trace_write(f, &first, r, ts, "interrupt", "s",
+                            ",\"cat\":\"irq\",\"id\":\"0x%lx\"", e -> b, 0);
+                break;
+            case TRACE_INTERRUPT_END:
+                trace_write(f, &first, r, ts, "send_interrupt", "E",
+                            NULL, 0, 0);
+                break;
+            }
+        }
+    }
+    fprintf(f, "\n]}\n");
+    return fclose(f) == 0 ? 0 : -1;
+}
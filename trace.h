@@ -0,0 +1,67 @@
+#ifndef __TRACE_H__
+#define __TRACE_H__ 1
+
+#include <stdint.h>
+
+/*
+ * Event tracer. Every host thread (each CPU and the network poll thread)
+ * records into its own ring buffer, so recording takes no lock and costs a
+ * cycle counter read and a few stores. When a ring is full the oldest events
+ * are overwritten. Tracing is off until trace_start; while it is off a
+ * tracepoint costs one load and a branch.
+ *
+ * trace_dump writes the rings in the Chrome trace event format, which
+ * chrome://tracing and ui.perfetto.dev both load. Each host thread is a track:
+ * the thread running on a CPU shows as a slice, do_alarms, network_handler
+ * and send_interrupt as nested slices, and schedule and semaphore operations
+ * as instant events. A flow arrow links each network interrupt from
+ * send_interrupt to the network_handler that ran it, which handles every
+ * packet that arrived meanwhile in the one slice.
+ */
+
+#define TRACE_EVENTS (1 << 16)      /* events per ring, a power of 2 */
+#define TRACE_RINGS 72              /* enough for MAX_CPUS and the network */
+
+typedef enum {
+    TRACE_SCHEDULE = 1,     /* a = thread, b = preempted */
+    TRACE_SWITCH,           /* a = previous thread, b = next thread */
+    TRACE_SEM_P,            /* a = semaphore, b = blocked */
+    TRACE_SEM_V,            /* a = semaphore, b = woke a thread */
+    TRACE_ALARMS_BEGIN,
+    TRACE_ALARMS_END,
+    TRACE_NETWORK_BEGIN,    /* a = packet that raised the interrupt */
+    TRACE_NETWORK_END,
+    TRACE_INTERRUPT_BEGIN,  /* a = interrupt type, b = argument */
+    TRACE_INTERRUPT_END
+} trace_type_t;
+
+extern volatile int trace_enabled;
+
+/*
+ * Give the calling host thread a ring named "name". Events recorded by host
+ * threads without a ring are dropped.
+ */
+void trace_attach(const char *name);
+
+/* Empty all rings and start recording */
+void trace_start();
+
+/* Stop recording */
+void trace_stop();
+
+/*
+ * Stop recording and write all rings to the file at "path" as Chrome trace
+ * JSON. Returns 0 on success and -1 if the file cannot be written.
+ */
+int trace_dump(const char *path);
+
+/* Record an event, use TRACE instead */
+void trace_record(trace_type_t type, uint64_t a, uint64_t b);
+
+#define TRACE(type, a, b) \
+    do { \
+        if (trace_enabled) \
+            trace_record((type), (uint64_t) (a), (uint64_t) (b)); \
+    } while (0)
+
+#endif /*__TRACE_H__*/